@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/* Device backends */
+/* pread - positional syscalls on device file
+ * mmap  - device file mapped shared, I/O is memcpy, sync is msync
+ * mem   - image is read to memory at load, changes are never written back
+ * uring - io_uring batches, see uring.c */
+
+/* O_DIRECT */
+/******************************************************************************************/
+/* Device file is opened bypassing host page cache. Aligned requests go to
+ * device as is, others through aligned bounce buffer, partial sectors are
+ * read-modify-written under rmw_lock. */
+
+static int direct;
+static size_t direct_align = DFAT_DIRECT_ALIGN;
+static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set before dfat_load(), used by pread and uring backends */
+void dfat_set_direct(int on)
+{
+	direct = on;
+}
+
+/* Open device file for positional I/O, global fd */
+int dfat_open_device(const char *device)
+{
+	fd = open(device, O_RDWR | (direct ? O_DIRECT : 0));
+	if(fd < 0)
+		return -1;
+
+#ifdef STATX_DIOALIGN
+	struct statx st;
+
+	if(direct && statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &st) == 0 && (st.stx_mask & STATX_DIOALIGN))
+	{
+		if(st.stx_dio_mem_align > direct_align)
+			direct_align = st.stx_dio_mem_align;
+		if(st.stx_dio_offset_align > direct_align)
+			direct_align = st.stx_dio_offset_align;
+	}
+#endif
+
+	if(direct)
+		debug("FS\tO_DIRECT, alignment %u\n", (unsigned int) direct_align);
+
+	return 0;
+}
+
+/* Return 1 if request can go to device file as is */
+int dfat_io_aligned(const void *buf, size_t size, laddr_t offset)
+{
+	return !direct || ((uintptr_t) buf % direct_align == 0 && size % direct_align == 0
+	                   && offset % direct_align == 0);
+}
+
+/* Unaligned request under O_DIRECT through bounce buffer */
+ssize_t dfat_direct_rw(void *buf, size_t size, laddr_t offset, int write)
+{
+	laddr_t start = offset - offset % direct_align;
+	laddr_t end = (offset + size + direct_align - 1)/direct_align*direct_align;
+	size_t head = offset - start;
+	size_t span = end - start;
+	void *bounce;
+	ssize_t n;
+
+	if(posix_memalign(&bounce, direct_align, span))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if(write)
+	{
+		pthread_mutex_lock(&rmw_lock);
+
+		/* Keep bytes of partial sectors around request */
+		if(head || end != offset + size)
+		{
+			memset(bounce, 0, span);
+			ssize_t r = pread(fd, bounce, span, start);
+			dfat_stats_io(1, r, 0);
+			if(r < 0)
+			{
+				pthread_mutex_unlock(&rmw_lock);
+				free(bounce);
+				return -1;
+			}
+		}
+
+		memcpy((byte_t*) bounce + head, buf, size);
+		n = pwrite(fd, bounce, span, start);
+		dfat_stats_io(1, n, 1);
+
+		pthread_mutex_unlock(&rmw_lock);
+	}
+	else
+	{
+		n = pread(fd, bounce, span, start);
+		dfat_stats_io(1, n, 0);
+		if(n > 0)
+		{
+			size_t avail = (n > head) ? n - head : 0;
+			memcpy(buf, (byte_t*) bounce + head, (avail < size) ? avail : size);
+		}
+	}
+
+	free(bounce);
+
+	if(n < 0)
+		return -1;
+
+	/* Bytes of request itself */
+	n -= head;
+	if(n < 0)
+		n = 0;
+	return (n > size) ? size : n;
+}
+
+/* Run batch one request after another, vectored write by one call */
+static int serial_submit(struct dfat_io *io, int count)
+{
+	for(int i = 0; i < count; i++)
+	{
+		io[i].res = 0;
+
+		if(io[i].write && io[i].iovcnt > 1)
+		{
+			io[i].res = backend->writev_at(io[i].iov, io[i].iovcnt, io[i].offset);
+			if(io[i].res < 0)
+				io[i].res = -errno;
+			continue;
+		}
+
+		for(int j = 0; j < io[i].iovcnt; j++)
+		{
+			ssize_t n = io[i].write
+				? backend->write_at(io[i].iov[j].iov_base, io[i].iov[j].iov_len, io[i].offset + io[i].res)
+				: backend->read_at(io[i].iov[j].iov_base, io[i].iov[j].iov_len, io[i].offset + io[i].res);
+
+			if(n < 0)
+			{
+				if(io[i].res == 0)
+					io[i].res = -errno;
+				break;
+			}
+
+			io[i].res += n;
+			if(n < io[i].iov[j].iov_len)
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/* pread backend */
+/******************************************************************************************/
+static int file_open(const char *device)
+{
+	return dfat_open_device(device);
+}
+
+static ssize_t file_read_at(void *buf, size_t size, laddr_t offset)
+{
+	if(!dfat_io_aligned(buf, size, offset))
+		return dfat_direct_rw(buf, size, offset, 0);
+
+	ssize_t n = pread(fd, buf, size, offset);
+	dfat_stats_io(1, n, 0);
+	return n;
+}
+
+static ssize_t file_write_at(const void *buf, size_t size, laddr_t offset)
+{
+	if(!dfat_io_aligned(buf, size, offset))
+		return dfat_direct_rw((void*) buf, size, offset, 1);
+
+	ssize_t n = pwrite(fd, buf, size, offset);
+	dfat_stats_io(1, n, 1);
+	return n;
+}
+
+static ssize_t file_writev_at(const struct iovec *iov, int count, laddr_t offset)
+{
+	ssize_t done = 0;
+
+	for(int i = 0; i < count; i++)
+	{
+		if(!dfat_io_aligned(iov[i].iov_base, iov[i].iov_len, offset + done))
+		{
+			/* Vector by parts from its start, unaligned ones are bounced */
+			done = 0;
+			for(i = 0; i < count; i++)
+			{
+				ssize_t n = file_write_at(iov[i].iov_base, iov[i].iov_len, offset + done);
+
+				if(n < 0)
+					return done ? done : n;
+				done += n;
+				if(n < iov[i].iov_len)
+					break;
+			}
+			return done;
+		}
+		done += iov[i].iov_len;
+	}
+
+	ssize_t n = pwritev(fd, iov, count, offset);
+	dfat_stats_io(1, n, 1);
+	return n;
+}
+
+static int file_sync()
+{
+	dfat_stats_io(1, 0, 0);
+	return fdatasync(fd);
+}
+
+static laddr_t file_size()
+{
+	struct stat st;
+
+	return (fstat(fd, &st) < 0) ? 0 : st.st_size;
+}
+
+static void file_close()
+{
+	close(fd);
+}
+
+static struct dfat_backend file_backend = {
+	"pread", file_open, file_read_at, file_write_at, file_writev_at, file_sync, file_size, file_close,
+	serial_submit, NULL
+};
+
+/* Memory image, shared by mmap and mem backends */
+/******************************************************************************************/
+static byte_t *image;
+static laddr_t image_size;
+
+static ssize_t image_read_at(void *buf, size_t size, laddr_t offset)
+{
+	if(offset >= image_size)
+		return 0;
+	if(size > image_size - offset)
+		size = image_size - offset;
+
+	memcpy(buf, image + offset, size);
+	dfat_stats_io(0, size, 0);
+	return size;
+}
+
+static ssize_t image_write_at(const void *buf, size_t size, laddr_t offset)
+{
+	if(offset >= image_size)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+	if(size > image_size - offset)
+		size = image_size - offset;
+
+	memcpy(image + offset, buf, size);
+	dfat_stats_io(0, size, 1);
+	return size;
+}
+
+static ssize_t image_writev_at(const struct iovec *iov, int count, laddr_t offset)
+{
+	ssize_t done = 0;
+
+	for(int i = 0; i < count; i++)
+	{
+		ssize_t n = image_write_at(iov[i].iov_base, iov[i].iov_len, offset + done);
+
+		if(n < 0)
+			return done ? done : n;
+		done += n;
+		if(n < iov[i].iov_len)
+			break;
+	}
+
+	return done;
+}
+
+static laddr_t image_length()
+{
+	return image_size;
+}
+
+/* mmap backend */
+/******************************************************************************************/
+/* Mapped and memory images don't use O_DIRECT */
+static int mmap_open(const char *device)
+{
+	fd = open(device, O_RDWR);
+	if(fd < 0)
+		return -1;
+
+	image_size = file_size();
+	image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if(image == MAP_FAILED)
+	{
+		image = NULL;
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mmap_sync()
+{
+	dfat_stats_io(1, 0, 0);
+	return msync(image, image_size, MS_SYNC);
+}
+
+static void mmap_close()
+{
+	munmap(image, image_size);
+	image = NULL;
+	close(fd);
+}
+
+static struct dfat_backend mmap_backend = {
+	"mmap", mmap_open, image_read_at, image_write_at, image_writev_at, mmap_sync, image_length, mmap_close,
+	serial_submit, NULL
+};
+
+/* In-memory backend */
+/******************************************************************************************/
+static int mem_open(const char *device)
+{
+	fd = open(device, O_RDWR);
+	if(fd < 0)
+		return -1;
+
+	image_size = file_size();
+	image = malloc(image_size);
+
+	if(image == NULL || pread(fd, image, image_size, 0) < (ssize_t) image_size)
+	{
+		free(image);
+		image = NULL;
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	fd = -1;
+	return 0;
+}
+
+static int mem_sync()
+{
+	return 0;
+}
+
+static void mem_close()
+{
+	free(image);
+	image = NULL;
+}
+
+static struct dfat_backend mem_backend = {
+	"mem", mem_open, image_read_at, image_write_at, image_writev_at, mem_sync, image_length, mem_close,
+	serial_submit, NULL
+};
+
+/******************************************************************************************/
+/* Select backend by name before dfat_load(), return -1 if unknown */
+int dfat_set_backend(const char *name)
+{
+	struct dfat_backend *list[] = { &file_backend, &mmap_backend, &mem_backend, dfat_uring_backend() };
+
+	for(int i = 0; i < sizeof(list)/sizeof(list[0]); i++)
+	{
+		if(list[i] != NULL && strcmp(list[i]->name, name) == 0)
+		{
+			backend = list[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
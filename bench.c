@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include "libdfat.h"
+
+/* Microbenchmarks of libdfat */
+/* Scratch image is formatted, then every case drives library calls
+ * directly and reports ops/s, MB/s and latency percentiles as JSON on
+ * stdout. Write cases include final dfat_sync() in their time, so data
+ * reaches the image; per call latencies don't include it. */
+
+struct bench_config {
+	const char *image;
+	unsigned int image_mb;
+	unsigned short cluster_size;
+	unsigned int data_mb;
+	const char *backend;
+	int verbose;
+};
+
+struct bench_result {
+	unsigned long ops;
+	unsigned long bytes;
+	double seconds;
+	unsigned long *lat;
+};
+
+static char *data;
+static int results_count;
+
+static unsigned long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long*) a, y = *(const unsigned long*) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(struct bench_result *r, double part)
+{
+	if(r->ops == 0)
+		return 0;
+
+	unsigned long i = (unsigned long) (r->ops*part);
+	if(i >= r->ops)
+		i = r->ops - 1;
+
+	return r->lat[i]/1000.0;
+}
+
+static int result_init(struct bench_result *r, unsigned long ops)
+{
+	memset(r, 0, sizeof(*r));
+	r->lat = malloc((ops ? ops : 1)*sizeof(unsigned long));
+
+	return (r->lat == NULL) ? -ENOMEM : 0;
+}
+
+static void result_print(const char *name, unsigned int block, struct bench_result *r)
+{
+	qsort(r->lat, r->ops, sizeof(unsigned long), lat_cmp);
+
+	printf("%s\n    {\"name\": \"%s\", \"block\": %u, \"ops\": %lu, \"bytes\": %lu, \"seconds\": %.6f, "
+	       "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+	       "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f}",
+	       results_count++ ? "," : "", name, block, r->ops, r->bytes, r->seconds,
+	       r->seconds > 0 ? r->ops/r->seconds : 0.0,
+	       r->seconds > 0 ? r->bytes/r->seconds/(1 << 20) : 0.0,
+	       percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99), percentile(r, 0.999),
+	       r->ops ? r->lat[r->ops-1]/1000.0 : 0.0);
+	fflush(stdout);
+
+	free(r->lat);
+}
+
+/* Cases */
+/******************************************************************************************/
+static int bench_seq(const char *path, unsigned int block, unsigned long size, int write)
+{
+	struct bench_result r;
+	unsigned long count = size/block;
+
+	if(result_init(&r, count) < 0)
+		return -ENOMEM;
+
+	unsigned long start = now_ns();
+
+	for(unsigned long i = 0; i < count; i++)
+	{
+		unsigned long t = now_ns();
+		int n = write ? dfat_write(path, data, block, i*block) : dfat_read(path, data, block, i*block);
+
+		if(n != block)
+		{
+			fprintf(stderr, "bench_seq() %s at %lu: %d\n", path, i*block, n);
+			free(r.lat);
+			return -EIO;
+		}
+
+		r.lat[r.ops++] = now_ns() - t;
+		r.bytes += n;
+	}
+
+	if(write)
+		dfat_sync();
+	r.seconds = (now_ns() - start)/1e9;
+
+	result_print(write ? "seq_write" : "seq_read", block, &r);
+	return 0;
+}
+
+static int bench_rand(const char *path, unsigned int block, unsigned long size, int write)
+{
+	struct bench_result r;
+	unsigned long count = size/block;
+
+	if(result_init(&r, count) < 0)
+		return -ENOMEM;
+
+	srand(count);
+	unsigned long start = now_ns();
+
+	for(unsigned long i = 0; i < count; i++)
+	{
+		off_t offset = (off_t) (rand() % count)*block;
+		unsigned long t = now_ns();
+		int n = write ? dfat_write(path, data, block, offset) : dfat_read(path, data, block, offset);
+
+		if(n != block)
+		{
+			fprintf(stderr, "bench_rand() %s at %ld: %d\n", path, (long) offset, n);
+			free(r.lat);
+			return -EIO;
+		}
+
+		r.lat[r.ops++] = now_ns() - t;
+		r.bytes += n;
+	}
+
+	if(write)
+		dfat_sync();
+	r.seconds = (now_ns() - start)/1e9;
+
+	result_print(write ? "rand_write" : "rand_read", block, &r);
+	return 0;
+}
+
+/* Create, write and unlink small files in one folder */
+static int bench_small_files(unsigned int count, unsigned int block)
+{
+	struct bench_result c, u;
+	char path[64];
+
+	if(dfat_create("/small", 0x80, NULL) < 0 || result_init(&c, count) < 0)
+		return -EIO;
+	if(result_init(&u, count) < 0)
+	{
+		free(c.lat);
+		return -ENOMEM;
+	}
+
+	unsigned long start = now_ns();
+	for(unsigned int i = 0; i < count; i++)
+	{
+		sprintf(path, "/small/f%u", i);
+
+		unsigned long t = now_ns();
+		if(dfat_create(path, 0x0, NULL) < 0 || dfat_write(path, data, block, 0) != block)
+		{
+			fprintf(stderr, "bench_small_files() create %s failed\n", path);
+			free(c.lat);
+			free(u.lat);
+			return -EIO;
+		}
+		c.lat[c.ops++] = now_ns() - t;
+		c.bytes += block;
+	}
+	dfat_sync();
+	c.seconds = (now_ns() - start)/1e9;
+
+	start = now_ns();
+	for(unsigned int i = 0; i < count; i++)
+	{
+		sprintf(path, "/small/f%u", i);
+
+		unsigned long t = now_ns();
+		if(dfat_unlink(path) < 0)
+		{
+			fprintf(stderr, "bench_small_files() unlink %s failed\n", path);
+			free(c.lat);
+			free(u.lat);
+			return -EIO;
+		}
+		u.lat[u.ops++] = now_ns() - t;
+	}
+	dfat_sync();
+	u.seconds = (now_ns() - start)/1e9;
+
+	result_print("create_write", block, &c);
+	result_print("unlink", 0, &u);
+
+	return dfat_rmdir("/small");
+}
+
+/* dfat_find_dir_record() of file at the bottom of depth folders */
+static int bench_deep_lookup(unsigned int depth, unsigned int count)
+{
+	struct bench_result r;
+	char path[SIZE_NAME*4] = "";
+	dir_record_t rec;
+
+	for(unsigned int i = 0; i < depth; i++)
+	{
+		sprintf(path + strlen(path), "/d%u", i);
+		if(dfat_create(path, 0x80, NULL) < 0)
+			return -EIO;
+	}
+	strcat(path, "/leaf");
+	if(dfat_create(path, 0x0, NULL) < 0 || result_init(&r, count) < 0)
+		return -EIO;
+
+	unsigned long start = now_ns();
+	for(unsigned int i = 0; i < count; i++)
+	{
+		unsigned long t = now_ns();
+		if(!dfat_find_dir_record(path, &rec))
+		{
+			free(r.lat);
+			return -ENOENT;
+		}
+		r.lat[r.ops++] = now_ns() - t;
+	}
+	r.seconds = (now_ns() - start)/1e9;
+
+	result_print("deep_lookup", depth, &r);
+	return 0;
+}
+
+static int count_fill(void *ctx, const dir_record_t *r, off_t next)
+{
+	(*(unsigned long*) ctx)++;
+	return 0;
+}
+
+/* Listing of folder with count files. dfat_read_folder_by_path() returns
+ * first LIST_SIZE records only, so the whole folder is read by dfat_readdir_path() */
+static int bench_huge_dir(unsigned int count, unsigned int rounds)
+{
+	struct bench_result r, f;
+	char path[64];
+	struct list *l = malloc(sizeof(struct list));
+
+	if(l == NULL || dfat_create("/huge", 0x80, NULL) < 0)
+	{
+		free(l);
+		return -EIO;
+	}
+
+	for(unsigned int i = 0; i < count; i++)
+	{
+		sprintf(path, "/huge/file-with-longer-name-%u", i);
+		if(dfat_create(path, 0x0, NULL) < 0)
+		{
+			free(l);
+			return -EIO;
+		}
+	}
+	dfat_sync();
+
+	if(result_init(&r, rounds) < 0 || result_init(&f, rounds) < 0)
+	{
+		free(r.lat);
+		free(l);
+		return -ENOMEM;
+	}
+
+	unsigned long start = now_ns();
+	for(unsigned int i = 0; i < rounds; i++)
+	{
+		unsigned long seen = 0;
+		unsigned long t = now_ns();
+
+		if(dfat_readdir_path("/huge", 0, count_fill, &seen) < 0 || seen != count)
+		{
+			fprintf(stderr, "bench_huge_dir() listed %lu of %u\n", seen, count);
+			free(r.lat);
+			free(f.lat);
+			free(l);
+			return -EIO;
+		}
+		r.lat[r.ops++] = now_ns() - t;
+		r.bytes += seen*sizeof(dir_record_t);
+	}
+	r.seconds = (now_ns() - start)/1e9;
+
+	start = now_ns();
+	for(unsigned int i = 0; i < rounds; i++)
+	{
+		unsigned long t = now_ns();
+
+		list_clear(l);
+		if(dfat_read_folder_by_path("/huge", l) < 0)
+		{
+			free(r.lat);
+			free(f.lat);
+			free(l);
+			return -EIO;
+		}
+		f.lat[f.ops++] = now_ns() - t;
+		f.bytes += l->count*sizeof(dir_record_t);
+	}
+	f.seconds = (now_ns() - start)/1e9;
+
+	result_print("list_huge_dir", count, &r);
+	result_print("read_folder", LIST_SIZE, &f);
+
+	free(l);
+	return 0;
+}
+
+/******************************************************************************************/
+static int bench_usage()
+{
+	printf("dfat-bench [-i <image>] [-s <image MB>] [-c <cluster size>] [-n <data MB>]\n"
+	       "           [-b pread|mmap|mem|uring] [-v]\n\n"
+	       "Image is formatted and its content is lost. -v prints library stats to stderr.\n");
+	return -1;
+}
+
+int main(int argc, char** argv)
+{
+	struct bench_config conf = { "dfat-bench.img", 256, 4096, 32, "pread", 0 };
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp("-i", argv[i]) == 0 && i + 1 < argc)
+			conf.image = argv[++i];
+		else if(strcmp("-s", argv[i]) == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%u", &conf.image_mb);
+		else if(strcmp("-c", argv[i]) == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%hu", &conf.cluster_size);
+		else if(strcmp("-n", argv[i]) == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%u", &conf.data_mb);
+		else if(strcmp("-b", argv[i]) == 0 && i + 1 < argc)
+			conf.backend = argv[++i];
+		else if(strcmp("-v", argv[i]) == 0)
+			conf.verbose = 1;
+		else
+			return bench_usage();
+	}
+
+	unsigned long size = (unsigned long) conf.data_mb << 20;
+	if(size == 0 || size*2 > (unsigned long) conf.image_mb << 20)
+	{
+		fprintf(stderr, "data size must be under half of image\n");
+		return -1;
+	}
+
+	/* Image file of exact size, old content is dropped */
+	int dev = open(conf.image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(dev < 0 || ftruncate(dev, (off_t) conf.image_mb << 20) < 0)
+	{
+		perror(conf.image);
+		return -2;
+	}
+	close(dev);
+
+	int res = dfat_format(conf.image, 512, conf.cluster_size, "bench", DFAT_JOURNAL_SIZE);
+	if(res < 0)
+	{
+		fprintf(stderr, "dfat_format() %s: %s\n", conf.image, strerror(-res));
+		return -2;
+	}
+
+	if(dfat_set_backend(conf.backend) < 0)
+		return bench_usage();
+
+	if(dfat_load(conf.image) < 0)
+	{
+		fprintf(stderr, "dfat_load() %s failed\n", conf.image);
+		return -2;
+	}
+
+	data = malloc(1 << 20);
+	if(data == NULL)
+		return -3;
+	for(int i = 0; i < (1 << 20); i++)
+		data[i] = i*31 + (i >> 12);
+
+	printf("{\n  \"image\": \"%s\", \"image_mb\": %u, \"cluster_size\": %u, \"data_mb\": %u, \"backend\": \"%s\",\n"
+	       "  \"results\": [",
+	       conf.image, conf.image_mb, conf.cluster_size, conf.data_mb, conf.backend);
+
+	unsigned int blocks[] = { 4096, 65536, 1 << 20 };
+
+	for(int i = 0; i < sizeof(blocks)/sizeof(blocks[0]) && res == 0; i++)
+	{
+		char path[32];
+		sprintf(path, "/seq%u", blocks[i]);
+
+		res = dfat_create(path, 0x0, NULL);
+		if(res == 0)
+			res = bench_seq(path, blocks[i], size, 1);
+		if(res == 0)
+			res = bench_seq(path, blocks[i], size, 0);
+		if(res == 0 && blocks[i] < (1 << 20))
+			res = bench_rand(path, blocks[i], size/4, 1);
+		if(res == 0 && blocks[i] < (1 << 20))
+			res = bench_rand(path, blocks[i], size/4, 0);
+		if(res == 0)
+			res = dfat_unlink(path);
+	}
+
+	if(res == 0)
+		res = bench_small_files(5000, 1024);
+	if(res == 0)
+		res = bench_deep_lookup(16, 20000);
+	if(res == 0)
+		res = bench_huge_dir(5000, 50);
+
+	printf("\n  ]\n}\n");
+
+	if(conf.verbose)
+	{
+		size_t len = dfat_stats_format(NULL, 0) + 1;
+		char *report = malloc(len);
+		if(report != NULL)
+		{
+			dfat_stats_format(report, len);
+			fputs(report, stderr);
+			free(report);
+		}
+	}
+
+	dfat_close();
+	free(data);
+
+	if(res < 0)
+		fprintf(stderr, "benchmark failed: %s\n", strerror(-res));
+
+	return res < 0 ? 1 : 0;
+}
@@ -0,0 +1,310 @@
+#include "libdfat.h"
+
+#include <string.h>
+
+/* Free clusters bitmap */
+/* Bit (cluster-2) is set when cluster is free. Summary bit w is set
+ * when bitmap word w has at least one free cluster, so the search
+ * skips 4096 used clusters per summary word. */
+
+typedef unsigned long long bitmap_word_t;
+
+#define WORD_BITS (sizeof(bitmap_word_t)*8)
+
+static bitmap_word_t *words;
+static bitmap_word_t *summary;
+static size_t words_count;
+static size_t summary_count;
+static cluster_t clusters_count;
+static cluster_t free_count;
+
+/* Freed runs held out of allocation till their free is committed, else
+ * after crash replay could give cluster back to old file while it holds
+ * data of new owner. Kept in order of journal mark. */
+struct held_run {
+	cluster_t cluster;
+	cluster_t count;
+	unsigned long long mark;
+};
+
+static struct held_run *held;
+static size_t held_first, held_count, held_capacity;
+static cluster_t held_clusters;
+
+static void bitmap_mark_free(cluster_t bit)
+{
+	size_t w = bit / WORD_BITS;
+
+	words[w] |= 1ULL << (bit % WORD_BITS);
+	summary[w / WORD_BITS] |= 1ULL << (w % WORD_BITS);
+}
+
+static void bitmap_mark_used(cluster_t bit)
+{
+	size_t w = bit / WORD_BITS;
+
+	words[w] &= ~(1ULL << (bit % WORD_BITS));
+	if(words[w] == 0)
+		summary[w / WORD_BITS] &= ~(1ULL << (w % WORD_BITS));
+}
+
+/* Build bitmap from loaded FAT */
+int bitmap_load()
+{
+	clusters_count = fat_count;
+	words_count = (clusters_count + WORD_BITS - 1) / WORD_BITS;
+	summary_count = (words_count + WORD_BITS - 1) / WORD_BITS;
+
+	words = (bitmap_word_t*) calloc(words_count + 1, sizeof(bitmap_word_t));
+	summary = (bitmap_word_t*) calloc(summary_count + 1, sizeof(bitmap_word_t));
+
+	if(words == NULL || summary == NULL)
+	{
+		error("bitmap_load() can't allocate bitmap for %u clusters\n", clusters_count);
+		return -1;
+	}
+
+	free_count = 0;
+	for(cluster_t i = 2; i < clusters_count + 2; i++)
+	{
+		if(FAT[i].index == 0)
+		{
+			bitmap_mark_free(i - 2);
+			free_count++;
+		}
+	}
+
+	return 0;
+}
+
+void bitmap_close()
+{
+	free(words);
+	free(summary);
+	free(held);
+	words = summary = NULL;
+	held = NULL;
+	held_first = held_count = held_capacity = 0;
+	clusters_count = free_count = held_clusters = 0;
+}
+
+/* Return 0 if cluster is held, -1 if it must be freed at once */
+static int bitmap_hold(cluster_t cluster, unsigned long long mark)
+{
+	/* Chains are freed in order, extend last run */
+	if(held_count > held_first)
+	{
+		struct held_run *r = &held[held_count - 1];
+
+		if(r->cluster + r->count == cluster)
+		{
+			r->count++;
+			r->mark = mark;
+			held_clusters++;
+			return 0;
+		}
+	}
+
+	if(held_count == held_capacity)
+	{
+		if(held_first)
+		{
+			memmove(held, held + held_first, (held_count - held_first)*sizeof(*held));
+			held_count -= held_first;
+			held_first = 0;
+		}
+		else
+		{
+			size_t capacity = held_capacity ? held_capacity*2 : 64;
+			struct held_run *h = realloc(held, capacity*sizeof(*held));
+			if(h == NULL)
+			{
+				error("bitmap_hold() can't hold freed cluster %u\n", cluster);
+				return -1;
+			}
+
+			held = h;
+			held_capacity = capacity;
+		}
+	}
+
+	held[held_count].cluster = cluster;
+	held[held_count].count = 1;
+	held[held_count].mark = mark;
+	held_count++;
+	held_clusters++;
+	return 0;
+}
+
+/* FAT record of cluster changed from old to new value, mark is journal
+ * position of the change */
+void bitmap_update(cluster_t cluster, cluster_t old, cluster_t new, unsigned long long mark)
+{
+	if(cluster < 2 || cluster >= clusters_count + 2)
+		return;
+
+	if(old == 0 && new != 0)
+	{
+		bitmap_mark_used(cluster - 2);
+		free_count--;
+	}
+	else if(old != 0 && new == 0 && bitmap_hold(cluster, mark) < 0)
+	{
+		bitmap_mark_free(cluster - 2);
+		free_count++;
+	}
+}
+
+/* Give held clusters whose free is committed to allocation. With force
+ * pending FAT changes are committed first, when free space runs out.
+ * Return count of clusters made free */
+cluster_t bitmap_reclaim(int force)
+{
+	if(held_count == held_first)
+		return 0;
+
+	if(force && dfat_journal_force() < 0)
+		return 0;
+
+	unsigned long long committed = dfat_journal_committed();
+	cluster_t reclaimed = 0;
+
+	while(held_first < held_count && held[held_first].mark <= committed)
+	{
+		struct held_run *r = &held[held_first++];
+
+		for(cluster_t i = 0; i < r->count; i++)
+			bitmap_mark_free(r->cluster + i - 2);
+		reclaimed += r->count;
+	}
+
+	if(held_first == held_count)
+		held_first = held_count = 0;
+
+	free_count += reclaimed;
+	held_clusters -= reclaimed;
+	return reclaimed;
+}
+
+/* First free bit in [from, clusters_count), clusters_count if none */
+static cluster_t bitmap_scan(cluster_t from)
+{
+	if(from >= clusters_count)
+		return clusters_count;
+
+	size_t w = from / WORD_BITS;
+	bitmap_word_t bits = words[w] & (~0ULL << (from % WORD_BITS));
+
+	if(bits)
+		return w * WORD_BITS + __builtin_ctzll(bits);
+
+	/* Skip used words by summary */
+	w++;
+	size_t s = w / WORD_BITS;
+	if(s >= summary_count)
+		return clusters_count;
+
+	bitmap_word_t sbits = summary[s] & (~0ULL << (w % WORD_BITS));
+
+	while(!sbits)
+	{
+		if(++s >= summary_count)
+			return clusters_count;
+		sbits = summary[s];
+	}
+
+	w = s * WORD_BITS + __builtin_ctzll(sbits);
+	cluster_t bit = w * WORD_BITS + __builtin_ctzll(words[w]);
+
+	return (bit < clusters_count) ? bit : clusters_count;
+}
+
+/* First used bit in [from, clusters_count), clusters_count if none */
+static cluster_t bitmap_scan_used(cluster_t from)
+{
+	if(from >= clusters_count)
+		return clusters_count;
+
+	size_t w = from / WORD_BITS;
+	bitmap_word_t bits = ~words[w] & (~0ULL << (from % WORD_BITS));
+
+	while(!bits)
+	{
+		if(++w >= words_count)
+			return clusters_count;
+		bits = ~words[w];
+	}
+
+	cluster_t bit = w * WORD_BITS + __builtin_ctzll(bits);
+
+	return (bit < clusters_count) ? bit : clusters_count;
+}
+
+/* Length of free run starting at cluster start, not more than max */
+cluster_t bitmap_run(cluster_t start, cluster_t max)
+{
+	if(start < 2 || start >= clusters_count + 2)
+		return 0;
+
+	cluster_t end = bitmap_scan_used(start - 2);
+	cluster_t length = end - (start - 2);
+
+	return (length < max) ? length : max;
+}
+
+/* Best fit: smallest free extent with at least count clusters */
+/* If there is no such extent, the largest one. Return first cluster
+ * of extent and its length in *length, 0 if not free space */
+cluster_t bitmap_best_fit(cluster_t count, cluster_t *length)
+{
+	cluster_t best = 0, best_length = 0;
+	cluster_t bit = bitmap_scan(0);
+
+	while(bit < clusters_count)
+	{
+		cluster_t end = bitmap_scan_used(bit);
+		cluster_t extent = end - bit;
+
+		if(extent == count)
+		{
+			best = bit + 2;
+			best_length = extent;
+			break;
+		}
+
+		if( (best_length < count && extent > best_length)
+		    || (extent > count && extent < best_length) )
+		{
+			best = bit + 2;
+			best_length = extent;
+		}
+
+		bit = bitmap_scan(end);
+	}
+
+	*length = best_length;
+	return best;
+}
+
+/* Looking for free cluster starting at cluster from, wrap around at end */
+/* Return 0 if not free space */
+cluster_t bitmap_find_free(cluster_t from)
+{
+	if(free_count == 0)
+		return 0;
+
+	if(from < 2)
+		from = 2;
+
+	cluster_t bit = bitmap_scan(from - 2);
+	if(bit == clusters_count)
+		bit = bitmap_scan(0);
+
+	return (bit == clusters_count) ? 0 : bit + 2;
+}
+
+/* Held clusters count as free, they are given back at next commit */
+cluster_t bitmap_free_count()
+{
+	return free_count + held_clusters;
+}
@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+/* Write-back cluster cache */
+/* Directory clusters and partial data clusters live here; dirty ones reach
+ * the device on eviction or dfat_cache_flush(), after metadata journal is
+ * committed. Whole-cluster data runs bypass the cache, dfat_cache_prepare()
+ * keeps them coherent. */
+
+#define CACHE_NIL (-1)
+
+struct cache_entry {
+	/* Cached cluster, 0 - free entry */
+	cluster_t cluster;
+	byte_t *data;
+	unsigned char dirty;
+	/* CLOCK reference bit */
+	unsigned char referenced;
+	int next;
+};
+
+static struct cache_entry *entries;
+static int *buckets;
+static byte_t *slab;
+static unsigned int capacity;
+static unsigned int buckets_count;
+static unsigned int clock_hand;
+static unsigned int dirty_count;
+static unsigned int cache_size = DFAT_CACHE_SIZE;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cache_find(cluster_t cluster)
+{
+	for(int i = buckets[cluster % buckets_count]; i != CACHE_NIL; i = entries[i].next)
+	{
+		if(entries[i].cluster == cluster)
+			return i;
+	}
+
+	return CACHE_NIL;
+}
+
+static void cache_unlink(int i)
+{
+	int *p = &buckets[entries[i].cluster % buckets_count];
+
+	while(*p != CACHE_NIL && *p != i)
+		p = &entries[*p].next;
+
+	if(*p == i)
+		*p = entries[i].next;
+
+	entries[i].cluster = 0;
+}
+
+/* Metadata reaches its place only after it is in journal. Checkpoint is
+ * the only way to make room, so it writes in place when pending batch
+ * doesn't fit; on any other error dirty clusters stay in cache */
+static int cache_commit(int checkpoint)
+{
+	int res = dfat_journal_commit();
+
+	if(res == -ENOSPC && checkpoint)
+		return 0;
+	if(res < 0 && res != -ENOSPC)
+		error("cache_commit() journal: %s\n", strerror(-res));
+
+	return res;
+}
+
+static int cache_writeback(int i)
+{
+	if(cache_commit(0) < 0)
+		return -1;
+
+	ssize_t writed = backend->write_at(entries[i].data, sinfo.cluster_size,
+	                                   dfat_cluster_offset(entries[i].cluster));
+
+	if(writed < sinfo.cluster_size)
+	{
+		error("cache_writeback() %s cluster %u\n", strerror(errno), entries[i].cluster);
+		return -1;
+	}
+
+	dfat_trace(DFAT_TR_WRITEBACK, entries[i].cluster, 0);
+
+	entries[i].dirty = 0;
+	dirty_count--;
+	return 0;
+}
+
+/* CLOCK eviction, dirty victim is written back. If that fails, only
+ * clean entries are taken for the rest of the scan */
+static int cache_victim()
+{
+	int writeback = 1;
+
+	for(unsigned int step = 0; step < 2*capacity; step++)
+	{
+		int i = clock_hand;
+		clock_hand = (clock_hand + 1) % capacity;
+
+		if(entries[i].cluster == 0)
+			return i;
+
+		if(entries[i].referenced)
+		{
+			entries[i].referenced = 0;
+			continue;
+		}
+
+		if(entries[i].dirty && (!writeback || cache_writeback(i) < 0))
+		{
+			writeback = 0;
+			continue;
+		}
+
+		cache_unlink(i);
+		return i;
+	}
+
+	return CACHE_NIL;
+}
+
+/* Entry of cluster, loaded from device if load is set */
+static int cache_get(cluster_t cluster, int load)
+{
+	int i = cache_find(cluster);
+
+	if(i != CACHE_NIL)
+	{
+		entries[i].referenced = 1;
+		return i;
+	}
+
+	dfat_trace(DFAT_TR_CACHE_MISS, cluster, load);
+
+	i = cache_victim();
+	if(i == CACHE_NIL)
+		return CACHE_NIL;
+
+	if(load)
+	{
+		ssize_t readed = backend->read_at(entries[i].data, sinfo.cluster_size, dfat_cluster_offset(cluster));
+
+		if(readed < sinfo.cluster_size)
+		{
+			error("cache_get() %s cluster %u\n", strerror(errno), cluster);
+			return CACHE_NIL;
+		}
+	}
+
+	entries[i].cluster = cluster;
+	entries[i].dirty = 0;
+	entries[i].referenced = 1;
+	entries[i].next = buckets[cluster % buckets_count];
+	buckets[cluster % buckets_count] = i;
+
+	return i;
+}
+
+/* Capacity in clusters, takes effect at next dfat_cache_init() */
+void dfat_set_cache_size(unsigned int clusters)
+{
+	cache_size = clusters ? clusters : 1;
+}
+
+int dfat_cache_init()
+{
+	capacity = cache_size;
+	buckets_count = capacity*2;
+
+	entries = (struct cache_entry*) calloc(capacity, sizeof(struct cache_entry));
+	buckets = (int*) malloc(buckets_count*sizeof(int));
+	/* Aligned for O_DIRECT transfers */
+	if(posix_memalign((void**) &slab, DFAT_BUFFER_ALIGN, (size_t) capacity*sinfo.cluster_size))
+		slab = NULL;
+
+	if(entries == NULL || buckets == NULL || slab == NULL)
+	{
+		error("dfat_cache_init() can't allocate %u clusters\n", capacity);
+		return -1;
+	}
+
+	for(unsigned int i = 0; i < capacity; i++)
+		entries[i].data = slab + (size_t) i*sinfo.cluster_size;
+
+	for(unsigned int i = 0; i < buckets_count; i++)
+		buckets[i] = CACHE_NIL;
+
+	/* Cluster I/O of cache goes from this slab only */
+	if(backend->register_buffer != NULL)
+		backend->register_buffer(slab, (size_t) capacity*sinfo.cluster_size);
+
+	clock_hand = 0;
+	dirty_count = 0;
+
+	debug("FS\tcache: %u clusters\n", capacity);
+	return 0;
+}
+
+void dfat_cache_close()
+{
+	if(backend->register_buffer != NULL)
+		backend->register_buffer(NULL, 0);
+
+	free(entries);
+	free(buckets);
+	free(slab);
+	entries = NULL;
+	buckets = NULL;
+	slab = NULL;
+	capacity = 0;
+}
+
+int dfat_cache_read(cluster_t cluster, off_t offset, void *buf, size_t size)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	int i = cache_get(cluster, 1);
+	if(i != CACHE_NIL)
+		memcpy(buf, entries[i].data + offset, size);
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return (i == CACHE_NIL) ? -EIO : 0;
+}
+
+int dfat_cache_write(cluster_t cluster, off_t offset, const void *buf, size_t size)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	/* Whole cluster is overwritten, no need to read it */
+	int i = cache_get(cluster, offset != 0 || size != sinfo.cluster_size);
+	if(i != CACHE_NIL)
+	{
+		memcpy(entries[i].data + offset, buf, size);
+		if(!entries[i].dirty)
+			dirty_count++;
+		entries[i].dirty = 1;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return (i == CACHE_NIL) ? -EIO : 0;
+}
+
+/* Forget clusters, dirty data is dropped: clusters were freed */
+void dfat_cache_invalidate(cluster_t cluster, cluster_t count)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	for(cluster_t c = cluster; c < cluster + count; c++)
+	{
+		int i = cache_find(c);
+
+		if(i == CACHE_NIL)
+			continue;
+
+		if(entries[i].dirty)
+			dirty_count--;
+		entries[i].dirty = 0;
+		cache_unlink(i);
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* Count whole clusters started at cluster are going to be transferred
+ * directly with device: drop cached copies before write, write back dirty
+ * ones before read */
+int dfat_cache_prepare(cluster_t cluster, cluster_t count, int write)
+{
+	pthread_mutex_lock(&cache_lock);
+
+	for(cluster_t c = cluster; c < cluster + count; c++)
+	{
+		int i = cache_find(c);
+
+		if(i == CACHE_NIL)
+			continue;
+
+		if(write)
+		{
+			/* Cached copy is overwritten */
+			if(entries[i].dirty)
+				dirty_count--;
+			entries[i].dirty = 0;
+			cache_unlink(i);
+		}
+		else if(entries[i].dirty && cache_writeback(i) < 0)
+		{
+			/* Device must have latest data before it is read */
+			pthread_mutex_unlock(&cache_lock);
+			return -EIO;
+		}
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+static int cache_cmp(const void *a, const void *b)
+{
+	cluster_t ca = entries[*(const int*) a].cluster;
+	cluster_t cb = entries[*(const int*) b].cluster;
+
+	return (ca > cb) - (ca < cb);
+}
+
+/* Write back all dirty clusters in one backend batch */
+static int cache_flush(int checkpoint)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&cache_lock);
+
+	if(dirty_count == 0)
+	{
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	if((res = cache_commit(checkpoint)) < 0)
+	{
+		pthread_mutex_unlock(&cache_lock);
+		return res;
+	}
+
+	int *dirty = (int*) malloc(dirty_count*sizeof(int));
+	struct iovec *iov = (struct iovec*) malloc(dirty_count*sizeof(struct iovec));
+	struct dfat_io *io = (struct dfat_io*) malloc(dirty_count*sizeof(struct dfat_io));
+	unsigned int n = 0, runs = 0;
+
+	if(dirty == NULL || iov == NULL || io == NULL)
+	{
+		free(dirty);
+		free(iov);
+		free(io);
+		pthread_mutex_unlock(&cache_lock);
+		return -ENOMEM;
+	}
+
+	for(unsigned int i = 0; i < capacity; i++)
+	{
+		if(entries[i].cluster && entries[i].dirty)
+			dirty[n++] = i;
+	}
+
+	qsort(dirty, n, sizeof(int), cache_cmp);
+
+	/* One vectored write per run of consecutive clusters, all runs are
+	 * submitted together, so async backend has them in flight at once */
+	for(unsigned int i = 0; i < n; )
+	{
+		unsigned int run = 0;
+
+		do {
+			iov[i+run].iov_base = entries[dirty[i+run]].data;
+			iov[i+run].iov_len = sinfo.cluster_size;
+			run++;
+		} while(i + run < n && run < IOV_MAX
+		        && entries[dirty[i+run]].cluster == entries[dirty[i]].cluster + run);
+
+		io[runs].iov = &iov[i];
+		io[runs].iovcnt = run;
+		io[runs].offset = dfat_cluster_offset(entries[dirty[i]].cluster);
+		io[runs].write = 1;
+		io[runs].res = 0;
+		runs++;
+
+		i += run;
+	}
+
+	backend->submit(io, runs);
+
+	for(unsigned int r = 0, i = 0; r < runs; r++)
+	{
+		if(io[r].res < (ssize_t) io[r].iovcnt*sinfo.cluster_size)
+		{
+			error("dfat_cache_flush() %s cluster %u\n", strerror(io[r].res < 0 ? -io[r].res : EIO),
+			      entries[dirty[i]].cluster);
+			res = -EIO;
+		}
+		else
+		{
+			for(int j = 0; j < io[r].iovcnt; j++)
+				entries[dirty[i+j]].dirty = 0;
+			dirty_count -= io[r].iovcnt;
+		}
+
+		i += io[r].iovcnt;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	free(dirty);
+	free(iov);
+	free(io);
+
+	return res;
+}
+
+/* Called without FS locks, full journal is emptied by checkpoint first */
+int dfat_cache_flush()
+{
+	int res = cache_flush(0);
+
+	if(res == -ENOSPC)
+		res = dfat_journal_checkpoint();
+
+	return res;
+}
+
+/* Flush of dfat_journal_checkpoint(), under fat lock */
+int dfat_cache_checkpoint()
+{
+	return cache_flush(1);
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+/* Workload capture */
+/* Front end hands one record per callback, with paths it resolved, and
+ * dfat-replay drives the same calls against libdfat later. Records are
+ * appended under a mutex to a big stdio buffer, in order of completion,
+ * so start times of concurrent callbacks may go back a little. Tail in
+ * the buffer is lost if process dies before dfat_capture_stop(). */
+
+#define CAPTURE_BUFFER (1 << 20)
+
+static FILE *out;
+static char *buffer;
+static uint64_t start_ns;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *names[DFAT_CAP_OPS] = {
+	"lookup", "forget", "getattr", "setattr", "mkdir", "unlink", "rmdir", "rename",
+	"open", "create", "read", "write", "flush", "release", "fsync", "readdir", "fallocate"
+};
+
+const char *dfat_capture_name(unsigned int op)
+{
+	return (op < DFAT_CAP_OPS) ? names[op] : "unknown";
+}
+
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+uint64_t dfat_capture_clock()
+{
+	return clock_ns(CLOCK_MONOTONIC) - start_ns;
+}
+
+int dfat_capture_start(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if(f == NULL)
+		return -errno;
+
+	buffer = malloc(CAPTURE_BUFFER);
+	if(buffer != NULL)
+		setvbuf(f, buffer, _IOFBF, CAPTURE_BUFFER);
+
+	struct dfat_capture_header h = { DFAT_CAPTURE_MAGIC, 1, clock_ns(CLOCK_REALTIME) };
+	if(fwrite(&h, sizeof(h), 1, f) != 1)
+	{
+		fclose(f);
+		free(buffer);
+		buffer = NULL;
+		return -EIO;
+	}
+
+	start_ns = clock_ns(CLOCK_MONOTONIC);
+	out = f;
+	return 0;
+}
+
+void dfat_capture_stop()
+{
+	pthread_mutex_lock(&capture_lock);
+
+	if(out != NULL && fclose(out) != 0)
+		error("* dfat_capture_stop(): %s\n", strerror(errno));
+	out = NULL;
+	free(buffer);
+	buffer = NULL;
+
+	pthread_mutex_unlock(&capture_lock);
+}
+
+void dfat_capture(struct dfat_capture_record *r, const char *path, const char *path2)
+{
+	size_t len = (path != NULL) ? strlen(path) : 0;
+	size_t len2 = (path2 != NULL) ? strlen(path2) + 1 : 0;
+
+	/* Marked, so replay skips it instead of running op on empty path */
+	if(len + len2 >= DFAT_CAPTURE_OVERSIZE)
+	{
+		len = len2 = 0;
+		r->path_len = DFAT_CAPTURE_OVERSIZE;
+	}
+	else
+		r->path_len = len + len2;
+	r->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&capture_lock);
+
+	if(out != NULL)
+	{
+		int res = fwrite(r, sizeof(*r), 1, out) == 1;
+		if(res && len)
+			res = fwrite(path, len, 1, out) == 1;
+		if(res && len2)
+			res = fputc(0, out) != EOF && (len2 == 1 || fwrite(path2, len2 - 1, 1, out) == 1);
+
+		/* Broken capture is dropped, file system goes on */
+		if(!res)
+		{
+			error("* dfat_capture(): %s, capture stopped\n", strerror(errno));
+			fclose(out);
+			out = NULL;
+			free(buffer);
+			buffer = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&capture_lock);
+}
+
+int dfat_capture_read(FILE *in, struct dfat_capture_record *r, char *path, size_t size)
+{
+	if(fread(r, sizeof(*r), 1, in) != 1)
+		return feof(in) ? 0 : -EIO;
+
+	if(r->path_len == DFAT_CAPTURE_OVERSIZE)
+	{
+		path[0] = path[1] = 0;
+		return 1;
+	}
+
+	/* Two zeros, so second path of rename is always terminated */
+	if((size_t) r->path_len + 2 > size)
+		return -ENAMETOOLONG;
+
+	if(r->path_len && fread(path, r->path_len, 1, in) != 1)
+		return -EIO;
+
+	path[r->path_len] = 0;
+	path[r->path_len + 1] = 0;
+	return 1;
+}
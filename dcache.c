@@ -0,0 +1,280 @@
+#include "libdfat.h"
+
+#include <string.h>
+#include <pthread.h>
+
+/* Dentry cache: (parent folder cluster, name) -> dir record address */
+/* Entries with address 0 are negative: name is known to be absent */
+
+#define DCACHE_BUCKETS (DCACHE_SIZE*2)
+#define DCACHE_NIL (-1)
+
+struct dcache_entry {
+	/* First cluster of parent folder, 0 - free slot */
+	cluster_t parent;
+	unsigned int hash;
+	/* Record linear address, 0 - negative entry */
+	laddr_t addr;
+	/* Cached record, for negative entries only name is valid */
+	dir_record_t record;
+	/* CLOCK reference bit */
+	unsigned char referenced;
+	/* Bucket chains by (parent, name) and by address */
+	int next_name;
+	int next_addr;
+};
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+static int name_buckets[DCACHE_BUCKETS];
+static int addr_buckets[DCACHE_BUCKETS];
+static unsigned int clock_hand;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Incremented by every dir record write */
+static unsigned long dcache_writes;
+
+/* FNV-1a over name, mixed with parent cluster */
+static unsigned int dcache_hash(cluster_t parent, const char *name)
+{
+	unsigned int h = 2166136261u ^ parent;
+
+	while(*name)
+	{
+		h ^= (unsigned char) *name++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static unsigned int dcache_addr_bucket(laddr_t addr)
+{
+	return (addr / sizeof(dir_record_t)) % DCACHE_BUCKETS;
+}
+
+static void dcache_unlink_name(int i)
+{
+	int *p = &name_buckets[dcache[i].hash % DCACHE_BUCKETS];
+
+	while(*p != DCACHE_NIL && *p != i)
+		p = &dcache[*p].next_name;
+
+	if(*p == i)
+		*p = dcache[i].next_name;
+}
+
+static void dcache_unlink_addr(int i)
+{
+	if(dcache[i].addr == 0)
+		return;
+
+	int *p = &addr_buckets[dcache_addr_bucket(dcache[i].addr)];
+
+	while(*p != DCACHE_NIL && *p != i)
+		p = &dcache[*p].next_addr;
+
+	if(*p == i)
+		*p = dcache[i].next_addr;
+}
+
+static void dcache_link_addr(int i)
+{
+	if(dcache[i].addr == 0)
+		return;
+
+	unsigned int b = dcache_addr_bucket(dcache[i].addr);
+	dcache[i].next_addr = addr_buckets[b];
+	addr_buckets[b] = i;
+}
+
+static void dcache_drop(int i)
+{
+	dcache_unlink_name(i);
+	dcache_unlink_addr(i);
+	dcache[i].parent = 0;
+}
+
+static int dcache_find(cluster_t parent, const char *name, unsigned int hash)
+{
+	for(int i = name_buckets[hash % DCACHE_BUCKETS]; i != DCACHE_NIL; i = dcache[i].next_name)
+	{
+		if(dcache[i].hash == hash && dcache[i].parent == parent
+		   && strcmp(dcache[i].record.name, name) == 0)
+			return i;
+	}
+
+	return DCACHE_NIL;
+}
+
+static int dcache_find_addr(laddr_t addr)
+{
+	for(int i = addr_buckets[dcache_addr_bucket(addr)]; i != DCACHE_NIL; i = dcache[i].next_addr)
+	{
+		if(dcache[i].addr == addr)
+			return i;
+	}
+
+	return DCACHE_NIL;
+}
+
+/* CLOCK eviction: take free slot or first slot without reference bit */
+static int dcache_victim()
+{
+	while(1)
+	{
+		int i = clock_hand;
+		clock_hand = (clock_hand + 1) % DCACHE_SIZE;
+
+		if(dcache[i].parent == 0)
+			return i;
+
+		if(dcache[i].referenced)
+		{
+			dcache[i].referenced = 0;
+			continue;
+		}
+
+		dcache_drop(i);
+		return i;
+	}
+}
+
+void dcache_clear()
+{
+	pthread_mutex_lock(&dcache_lock);
+
+	for(int i = 0; i < DCACHE_SIZE; i++)
+		dcache[i].parent = 0;
+
+	for(int i = 0; i < DCACHE_BUCKETS; i++)
+	{
+		name_buckets[i] = DCACHE_NIL;
+		addr_buckets[i] = DCACHE_NIL;
+	}
+
+	clock_hand = 0;
+
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+int dcache_lookup(cluster_t parent, const char *name, dir_record_t *out_record, laddr_t *addr)
+{
+	pthread_mutex_lock(&dcache_lock);
+
+	int i = dcache_find(parent, name, dcache_hash(parent, name));
+
+	if(i == DCACHE_NIL)
+	{
+		pthread_mutex_unlock(&dcache_lock);
+		return 0;
+	}
+
+	dcache[i].referenced = 1;
+	*addr = dcache[i].addr;
+	if(out_record != NULL && dcache[i].addr != 0)
+		memcpy(out_record, &dcache[i].record, sizeof(dir_record_t));
+
+	pthread_mutex_unlock(&dcache_lock);
+	return 1;
+}
+
+static void dcache_set(cluster_t parent, const char *name, laddr_t addr, const dir_record_t *r)
+{
+	/* Such names can't be stored in dir record */
+	if(strlen(name) >= SIZE_NAME)
+		return;
+
+	unsigned int hash = dcache_hash(parent, name);
+	int i = dcache_find(parent, name, hash);
+
+	if(i == DCACHE_NIL)
+	{
+		i = dcache_victim();
+		dcache[i].parent = parent;
+		dcache[i].hash = hash;
+		dcache[i].addr = 0;
+		dcache[i].next_name = name_buckets[hash % DCACHE_BUCKETS];
+		name_buckets[hash % DCACHE_BUCKETS] = i;
+	}
+
+	dcache_unlink_addr(i);
+	dcache[i].addr = addr;
+	dcache_link_addr(i);
+
+	if(r != NULL)
+		memcpy(&dcache[i].record, r, sizeof(dir_record_t));
+	strcpy(dcache[i].record.name, name);
+	dcache[i].referenced = 1;
+}
+
+void dcache_insert(cluster_t parent, const char *name, laddr_t addr, const dir_record_t *r)
+{
+	pthread_mutex_lock(&dcache_lock);
+	dcache_set(parent, name, addr, r);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+unsigned long dcache_stamp()
+{
+	pthread_mutex_lock(&dcache_lock);
+	unsigned long stamp = dcache_writes;
+	pthread_mutex_unlock(&dcache_lock);
+
+	return stamp;
+}
+
+/* Insert only if no dir record was written since stamp was taken,
+ * otherwise record read from device may be already stale */
+void dcache_insert_stamped(unsigned long stamp, cluster_t parent, const char *name,
+                           laddr_t addr, const dir_record_t *r)
+{
+	pthread_mutex_lock(&dcache_lock);
+	if(stamp == dcache_writes)
+		dcache_set(parent, name, addr, r);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* Keep cache coherent with record written at address addr */
+void dcache_update(laddr_t addr, const dir_record_t *r)
+{
+	pthread_mutex_lock(&dcache_lock);
+	dcache_writes++;
+
+	int i = dcache_find_addr(addr);
+
+	if(i == DCACHE_NIL)
+	{
+		pthread_mutex_unlock(&dcache_lock);
+		return;
+	}
+
+	if(strcmp(dcache[i].record.name, r->name) == 0)
+	{
+		memcpy(&dcache[i].record, r, sizeof(dir_record_t));
+		pthread_mutex_unlock(&dcache_lock);
+		return;
+	}
+
+	/* Record was deleted or renamed: old name is absent now */
+	cluster_t parent = dcache[i].parent;
+	dcache_unlink_addr(i);
+	dcache[i].addr = 0;
+
+	if(r->name[0] != 0x0)
+		dcache_set(parent, r->name, addr, r);
+
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* Drop all entries of folder with first cluster parent */
+void dcache_purge(cluster_t parent)
+{
+	pthread_mutex_lock(&dcache_lock);
+
+	for(int i = 0; i < DCACHE_SIZE; i++)
+	{
+		if(dcache[i].parent == parent)
+			dcache_drop(i);
+	}
+
+	pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,465 @@
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Directory index: name hash -> record address, and free record slots */
+/* Built by one scan of folder at first lookup, kept in memory only, so it
+ * is rebuilt after mount. Callers hold folder lock, it guards index of the
+ * folder: building, probing and updates run under it. Leaf dindex_lock only
+ * guards table of indexes and pins, it is never held across I/O. Up to
+ * DINDEX_DIRS folders are indexed, least recently used index is dropped;
+ * pinned one is freed by its last user. */
+
+#define DINDEX_NIL (-1)
+
+struct dindex_node {
+	laddr_t addr;
+	unsigned int hash;
+	int next;
+};
+
+struct dindex {
+	/* First and last clusters of folder chain */
+	cluster_t dir;
+	cluster_t last;
+	/* Record slots of folder */
+	unsigned int records;
+	/* Names, chained by hash */
+	struct dindex_node *nodes;
+	unsigned int nodes_count, nodes_size;
+	int free_node;
+	int *buckets;
+	unsigned int buckets_count;
+	/* Free slots stack, entries taken since push are dropped lazily */
+	laddr_t *slots;
+	unsigned int slots_count, slots_size;
+	unsigned long used;
+	/* Pins of callers, index out of table is freed at last unpin */
+	unsigned int users;
+	int dropped;
+};
+
+static struct dindex *indexes[DINDEX_DIRS];
+static unsigned long dindex_tick;
+static pthread_mutex_t dindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a over name */
+static unsigned int dindex_hash(const char *name)
+{
+	unsigned int h = 2166136261u;
+
+	while(*name)
+	{
+		h ^= (unsigned char) *name++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void dindex_free(struct dindex *d)
+{
+	free(d->nodes);
+	free(d->buckets);
+	free(d->slots);
+	free(d);
+}
+
+static int dindex_rehash(struct dindex *d, unsigned int count)
+{
+	int *buckets = malloc(count*sizeof(int));
+	if(buckets == NULL)
+		return -ENOMEM;
+
+	for(unsigned int i = 0; i < count; i++)
+		buckets[i] = DINDEX_NIL;
+
+	for(unsigned int i = 0; i < d->nodes_count; i++)
+	{
+		if(d->nodes[i].addr == 0)
+			continue;
+
+		unsigned int b = d->nodes[i].hash & (count - 1);
+		d->nodes[i].next = buckets[b];
+		buckets[b] = i;
+	}
+
+	free(d->buckets);
+	d->buckets = buckets;
+	d->buckets_count = count;
+
+	return 0;
+}
+
+static int dindex_add(struct dindex *d, unsigned int hash, laddr_t addr)
+{
+	int i = d->free_node;
+
+	if(i != DINDEX_NIL)
+		d->free_node = d->nodes[i].next;
+	else
+	{
+		if(d->nodes_count == d->nodes_size)
+		{
+			unsigned int size = d->nodes_size ? d->nodes_size*2 : 64;
+			struct dindex_node *nodes = realloc(d->nodes, size*sizeof(struct dindex_node));
+
+			if(nodes == NULL)
+				return -ENOMEM;
+
+			d->nodes = nodes;
+			d->nodes_size = size;
+		}
+
+		i = d->nodes_count++;
+	}
+
+	d->nodes[i].addr = addr;
+	d->nodes[i].hash = hash;
+
+	/* Load factor up to 2 */
+	if(d->nodes_count > 2*d->buckets_count)
+		return dindex_rehash(d, d->buckets_count*2);
+
+	unsigned int b = hash & (d->buckets_count - 1);
+	d->nodes[i].next = d->buckets[b];
+	d->buckets[b] = i;
+
+	return 0;
+}
+
+static int dindex_push(struct dindex *d, laddr_t addr)
+{
+	if(d->slots_count == d->slots_size)
+	{
+		unsigned int size = d->slots_size ? d->slots_size*2 : 64;
+		laddr_t *slots = realloc(d->slots, size*sizeof(laddr_t));
+
+		if(slots == NULL)
+			return -ENOMEM;
+
+		d->slots = slots;
+		d->slots_size = size;
+	}
+
+	d->slots[d->slots_count++] = addr;
+	return 0;
+}
+
+/* Add records of folder cluster */
+static int dindex_scan(struct dindex *d, cluster_t cluster)
+{
+	cluster_t ecount = sinfo.cluster_size/sizeof(dir_record_t);
+	dir_record_t records[ecount];
+
+	if( dfat_read_dir_cluster(cluster, records) < 0 )
+		return -EIO;
+
+	/* Pushed backwards, so free slots are taken in folder order */
+	for(int i = ecount - 1; i >= 0; i--)
+	{
+		laddr_t addr = dfat_cluster_offset(cluster) + i*sizeof(dir_record_t);
+		int res = (records[i].name[0] != 0x0) ? dindex_add(d, dindex_hash(records[i].name), addr)
+		                                      : dindex_push(d, addr);
+		if(res < 0)
+			return res;
+	}
+
+	d->records += ecount;
+	d->last = cluster;
+
+	return 0;
+}
+
+static struct dindex *dindex_build(cluster_t dir)
+{
+	struct dindex *d = calloc(1, sizeof(struct dindex));
+
+	if(d == NULL || dindex_rehash(d, 64) < 0)
+	{
+		free(d);
+		return NULL;
+	}
+
+	d->dir = dir;
+	d->free_node = DINDEX_NIL;
+
+	/* Clusters are scanned from the end, so free slots of first one are on top */
+	cluster_t count = 0;
+	for(cluster_t c = dir; c > 1; c = FAT[c].index)
+		count++;
+
+	cluster_t *chain = malloc(count*sizeof(cluster_t));
+	if(chain == NULL)
+	{
+		dindex_free(d);
+		return NULL;
+	}
+
+	count = 0;
+	for(cluster_t c = dir; c > 1; c = FAT[c].index)
+		chain[count++] = c;
+
+	for(cluster_t i = count; i > 0; i--)
+	{
+		if(dindex_scan(d, chain[i-1]) < 0)
+		{
+			free(chain);
+			dindex_free(d);
+			return NULL;
+		}
+	}
+
+	d->last = chain[count-1];
+	free(chain);
+
+	debug("dindex_build() folder %u: %u records, %u names\n", dir, d->records, d->nodes_count);
+	return d;
+}
+
+static int dindex_slot(cluster_t dir)
+{
+	for(int i = 0; i < DINDEX_DIRS; i++)
+	{
+		if(indexes[i] != NULL && indexes[i]->dir == dir)
+			return i;
+	}
+
+	return DINDEX_NIL;
+}
+
+/* Take index out of table. Called under dindex_lock */
+static void dindex_detach(int i)
+{
+	struct dindex *d = indexes[i];
+
+	indexes[i] = NULL;
+	if(d->users)
+		d->dropped = 1;
+	else
+		dindex_free(d);
+}
+
+static void dindex_forget(cluster_t dir)
+{
+	pthread_mutex_lock(&dindex_lock);
+
+	int i = dindex_slot(dir);
+	if(i != DINDEX_NIL)
+		dindex_detach(i);
+
+	pthread_mutex_unlock(&dindex_lock);
+}
+
+/* Index of folder pinned till dindex_put(), built if build is set. Folder
+ * lock of caller keeps others from building the same index meanwhile */
+static struct dindex *dindex_get(cluster_t dir, int build)
+{
+	pthread_mutex_lock(&dindex_lock);
+
+	int i = dindex_slot(dir);
+	if(i != DINDEX_NIL)
+	{
+		/* Slot may be given to other folder as soon as lock is released */
+		struct dindex *d = indexes[i];
+		d->users++;
+		d->used = ++dindex_tick;
+		pthread_mutex_unlock(&dindex_lock);
+		return d;
+	}
+
+	pthread_mutex_unlock(&dindex_lock);
+
+	if(!build)
+		return NULL;
+
+	struct dindex *d = dindex_build(dir);
+	if(d == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&dindex_lock);
+
+	/* Take empty place or least recently used one */
+	i = 0;
+	for(int j = 0; j < DINDEX_DIRS; j++)
+	{
+		if(indexes[j] == NULL)
+		{
+			i = j;
+			break;
+		}
+
+		if(indexes[j]->used < indexes[i]->used)
+			i = j;
+	}
+
+	if(indexes[i] != NULL)
+		dindex_detach(i);
+	indexes[i] = d;
+	d->users = 1;
+	d->used = ++dindex_tick;
+
+	pthread_mutex_unlock(&dindex_lock);
+	return d;
+}
+
+static void dindex_put(struct dindex *d)
+{
+	pthread_mutex_lock(&dindex_lock);
+
+	if(--d->users == 0 && d->dropped)
+		dindex_free(d);
+
+	pthread_mutex_unlock(&dindex_lock);
+}
+
+/* Lookup */
+/******************************************************************************************/
+/* Return 1 if folder is indexed, *addr = 0 if name is absent */
+int dindex_lookup(cluster_t dir, const char *name, dir_record_t *out_record, laddr_t *addr)
+{
+	struct dindex *d = dindex_get(dir, 1);
+	if(d == NULL)
+		return 0;
+
+	unsigned int hash = dindex_hash(name);
+	*addr = 0;
+
+	for(int i = d->buckets[hash & (d->buckets_count - 1)]; i != DINDEX_NIL; i = d->nodes[i].next)
+	{
+		dir_record_t r;
+
+		if(d->nodes[i].hash != hash || dfat_read_record(d->nodes[i].addr, &r) < 0)
+			continue;
+
+		if(strcmp(r.name, name) == 0)
+		{
+			*addr = d->nodes[i].addr;
+			if(out_record != NULL)
+				memcpy(out_record, &r, sizeof(r));
+			break;
+		}
+	}
+
+	dindex_put(d);
+	return 1;
+}
+
+/* Return 1 if folder is indexed, *addr = 0 if folder has no free slot.
+ * Slot stays free until record with name is written there.
+ * *last is last cluster of folder chain. */
+int dindex_free_slot(cluster_t dir, laddr_t *addr, cluster_t *last)
+{
+	struct dindex *d = dindex_get(dir, 1);
+	if(d == NULL)
+		return 0;
+
+	*addr = 0;
+	*last = d->last;
+
+	while(d->slots_count)
+	{
+		dir_record_t r;
+		laddr_t slot = d->slots[d->slots_count-1];
+
+		if(dfat_read_record(slot, &r) == 0 && r.name[0] == 0x0)
+		{
+			*addr = slot;
+			break;
+		}
+
+		d->slots_count--;
+	}
+
+	dindex_put(d);
+	return 1;
+}
+
+/* Update */
+/******************************************************************************************/
+/* Record with name was written at addr */
+void dindex_insert(cluster_t dir, const char *name, laddr_t addr)
+{
+	struct dindex *d = dindex_get(dir, 0);
+	if(d == NULL)
+		return;
+
+	unsigned int hash = dindex_hash(name);
+
+	/* Replaced record keeps its name and place */
+	for(int i = d->buckets[hash & (d->buckets_count - 1)]; i != DINDEX_NIL; i = d->nodes[i].next)
+	{
+		if(d->nodes[i].addr == addr)
+		{
+			dindex_put(d);
+			return;
+		}
+	}
+
+	if(dindex_add(d, hash, addr) < 0)
+		dindex_forget(dir);
+
+	dindex_put(d);
+}
+
+/* Record with name at addr was deleted */
+void dindex_remove(cluster_t dir, const char *name, laddr_t addr)
+{
+	struct dindex *d = dindex_get(dir, 0);
+	if(d == NULL)
+		return;
+
+	int *p = &d->buckets[dindex_hash(name) & (d->buckets_count - 1)];
+
+	while(*p != DINDEX_NIL && d->nodes[*p].addr != addr)
+		p = &d->nodes[*p].next;
+
+	if(*p != DINDEX_NIL)
+	{
+		int i = *p;
+		*p = d->nodes[i].next;
+		d->nodes[i].addr = 0;
+		d->nodes[i].next = d->free_node;
+		d->free_node = i;
+	}
+
+	/* Stack holds stale slots of renamed records, start over if it grew too much */
+	if(d->slots_count >= d->records || dindex_push(d, addr) < 0)
+		dindex_forget(dir);
+
+	dindex_put(d);
+}
+
+/* Cluster was appended to folder chain and cleared */
+void dindex_grow(cluster_t dir, cluster_t cluster)
+{
+	struct dindex *d = dindex_get(dir, 0);
+	if(d == NULL)
+		return;
+
+	if(dindex_scan(d, cluster) < 0)
+		dindex_forget(dir);
+
+	dindex_put(d);
+}
+
+/* Forget index of removed folder */
+void dindex_drop(cluster_t dir)
+{
+	dindex_forget(dir);
+}
+
+void dindex_clear()
+{
+	pthread_mutex_lock(&dindex_lock);
+
+	for(int i = 0; i < DINDEX_DIRS; i++)
+	{
+		if(indexes[i] != NULL)
+			dindex_detach(i);
+	}
+
+	pthread_mutex_unlock(&dindex_lock);
+}
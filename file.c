@@ -0,0 +1,759 @@
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Open files table */
+/* One shared object per dir record address, so every handle of a file
+ * sees the same cached record. Table and refs are guarded by files_lock,
+ * record and data - by file lock of first cluster. */
+
+#define FILES_BUCKETS 256
+
+static dfat_file_t *files[FILES_BUCKETS];
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int files_bucket(laddr_t addr)
+{
+	return (addr / sizeof(dir_record_t)) % FILES_BUCKETS;
+}
+
+static dfat_file_t *files_find(laddr_t addr)
+{
+	for(dfat_file_t *f = files[files_bucket(addr)]; f != NULL; f = f->next)
+	{
+		if(f->addr == addr)
+			return f;
+	}
+
+	return NULL;
+}
+
+static void files_remove(dfat_file_t *f)
+{
+	dfat_file_t **p = &files[files_bucket(f->addr)];
+
+	while(*p != NULL && *p != f)
+		p = &(*p)->next;
+
+	if(*p == f)
+		*p = f->next;
+}
+
+static void files_insert(dfat_file_t *f)
+{
+	unsigned int b = files_bucket(f->addr);
+
+	f->next = files[b];
+	files[b] = f;
+}
+
+/* Change generations */
+/* Global counter stamped into slot of first cluster at every change of file
+ * data or size. Slots are shared by clusters equal modulo GEN_BUCKETS, so a
+ * collision only makes file look changed. */
+
+#define GEN_BUCKETS 4096
+
+static unsigned long generations[GEN_BUCKETS];
+static unsigned long generation;
+/* Exact slot per cluster, stamped only when cluster is handed to a new file
+ * or folder. Not hashed: FUSE reports it as inode generation, and a change
+ * for a live inode makes kernel drop it as stale. */
+static unsigned long *births;
+static cluster_t births_count;
+
+int dfat_file_init()
+{
+	births_count = fat_count + 2;
+	births = (unsigned long*) calloc(births_count, sizeof(unsigned long));
+	if(births == NULL)
+	{
+		error("dfat_file_init() can't allocate generations for %u clusters\n", fat_count);
+		return -1;
+	}
+
+	return 0;
+}
+
+void dfat_file_close()
+{
+	free(births);
+	births = NULL;
+	births_count = 0;
+}
+
+void dfat_file_changed(cluster_t first)
+{
+	unsigned long g = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&generations[first % GEN_BUCKETS], g, __ATOMIC_RELEASE);
+}
+
+unsigned long dfat_file_generation(cluster_t first)
+{
+	return __atomic_load_n(&generations[first % GEN_BUCKETS], __ATOMIC_ACQUIRE);
+}
+
+/* Cluster became first cluster of new file or folder, counts as change too */
+void dfat_file_born(cluster_t first)
+{
+	unsigned long g = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+	if(first < births_count)
+		__atomic_store_n(&births[first], g, __ATOMIC_RELEASE);
+	__atomic_store_n(&generations[first % GEN_BUCKETS], g, __ATOMIC_RELEASE);
+}
+
+/* Grows at every reuse of cluster, 0 for files older than mount */
+unsigned long dfat_file_birth(cluster_t first)
+{
+	if(first >= births_count)
+		return 0;
+	return __atomic_load_n(&births[first], __ATOMIC_ACQUIRE);
+}
+
+/* Extent map */
+/******************************************************************************************/
+/* Append cluster to the end of map */
+static int map_append(dfat_file_t *f, cluster_t cluster)
+{
+	if(f->extents_count)
+	{
+		struct dfat_extent *e = &f->extents[f->extents_count-1];
+
+		if(e->physical + e->length == cluster)
+		{
+			e->length++;
+			f->clusters++;
+			return 0;
+		}
+	}
+
+	if(f->extents_count == f->extents_size)
+	{
+		unsigned int size = f->extents_size ? f->extents_size*2 : 8;
+		struct dfat_extent *extents = realloc(f->extents, size*sizeof(struct dfat_extent));
+
+		if(extents == NULL)
+			return -ENOMEM;
+
+		f->extents = extents;
+		f->extents_size = size;
+	}
+
+	struct dfat_extent *e = &f->extents[f->extents_count++];
+	e->logical = f->clusters;
+	e->physical = cluster;
+	e->length = 1;
+	f->clusters++;
+
+	return 0;
+}
+
+/* Append chain started at cluster */
+static int map_walk(dfat_file_t *f, cluster_t cluster)
+{
+	while(cluster > 1)
+	{
+		if(map_append(f, cluster) < 0)
+		{
+			f->map_valid = 0;
+			return -ENOMEM;
+		}
+		cluster = FAT[cluster].index;
+	}
+
+	return 0;
+}
+
+/* Build map on first access */
+static int map_load(dfat_file_t *f)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&f->map_lock);
+
+	if(!f->map_valid)
+	{
+		f->extents_count = 0;
+		f->clusters = 0;
+		res = map_walk(f, f->first);
+		f->map_valid = (res == 0);
+		if(f->map_valid)
+			dfat_stats_extents(f->extents_count);
+	}
+
+	pthread_mutex_unlock(&f->map_lock);
+
+	return res;
+}
+
+/* Binary search of extent with logical cluster, -1 if beyond chain */
+static int map_find(dfat_file_t *f, cluster_t logical)
+{
+	int lo = 0, hi = (int) f->extents_count - 1;
+
+	if(logical >= f->clusters)
+		return -1;
+
+	while(lo < hi)
+	{
+		int mid = (lo + hi + 1)/2;
+
+		if(f->extents[mid].logical <= logical)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/* Whole-cluster transfers of one request, submitted to backend together */
+#define MAP_BATCH 64
+
+struct map_batch {
+	struct dfat_io io[MAP_BATCH];
+	struct iovec iov[MAP_BATCH];
+	int count;
+	/* Request buffer and bytes of it before first failed transfer */
+	byte_t *base;
+	size_t failed;
+};
+
+static void batch_submit(struct map_batch *b)
+{
+	if(b->count == 0)
+		return;
+
+	backend->submit(b->io, b->count);
+
+	for(int i = 0; i < b->count; i++)
+	{
+		if(b->io[i].res < (ssize_t) b->iov[i].iov_len)
+		{
+			size_t at = (byte_t*) b->iov[i].iov_base - b->base + (b->io[i].res > 0 ? b->io[i].res : 0);
+
+			error("batch_submit() %s at 0x%lX\n", strerror(b->io[i].res < 0 ? -b->io[i].res : EIO),
+			      b->io[i].offset);
+			if(at < b->failed)
+				b->failed = at;
+		}
+	}
+
+	b->count = 0;
+}
+
+/* Transfer size bytes at cluster_offset of contiguous run started at cluster */
+/* Partial clusters go through block cache, whole clusters are queued to batch */
+static ssize_t run_rw(cluster_t cluster, off_t cluster_offset, byte_t *buf, size_t size, int write,
+                      struct map_batch *b)
+{
+	size_t done = 0;
+
+	while(done < size)
+	{
+		if(cluster_offset != 0 || size - done < sinfo.cluster_size)
+		{
+			size_t n = sinfo.cluster_size - cluster_offset;
+			if(n > size - done)
+				n = size - done;
+
+			int res = write ? dfat_cache_write(cluster, cluster_offset, buf + done, n)
+			                : dfat_cache_read(cluster, cluster_offset, buf + done, n);
+			if(res < 0)
+				return done ? done : res;
+
+			done += n;
+			cluster++;
+			cluster_offset = 0;
+			continue;
+		}
+
+		cluster_t count = (size - done)/sinfo.cluster_size;
+
+		if(dfat_cache_prepare(cluster, count, write) < 0)
+			return done ? done : -EIO;
+
+		if(b->count == MAP_BATCH)
+			batch_submit(b);
+
+		struct dfat_io *io = &b->io[b->count];
+		b->iov[b->count].iov_base = buf + done;
+		b->iov[b->count].iov_len = (size_t) count*sinfo.cluster_size;
+		io->iov = &b->iov[b->count];
+		io->iovcnt = 1;
+		io->offset = dfat_cluster_offset(cluster);
+		io->write = write;
+		b->count++;
+
+		done += (size_t) count*sinfo.cluster_size;
+		cluster += count;
+	}
+
+	return done;
+}
+
+/* Read or write size bytes at offset of file, extent by extent */
+/* Whole-cluster parts of all extents go to device as one batch */
+static ssize_t map_rw(dfat_file_t *f, off_t offset, void *buf, size_t size, int write)
+{
+	cluster_t logical = offset / sinfo.cluster_size;
+	off_t cluster_offset = offset % sinfo.cluster_size;
+	size_t done = 0;
+	ssize_t res = 0;
+	struct map_batch b;
+
+	b.count = 0;
+	b.base = buf;
+	b.failed = size;
+
+	for(int i = map_find(f, logical); i >= 0 && i < f->extents_count && done < size; i++)
+	{
+		struct dfat_extent *e = &f->extents[i];
+		cluster_t skip = logical - e->logical;
+		size_t run_size = (size_t)(e->length - skip)*sinfo.cluster_size - cluster_offset;
+
+		if(run_size > size - done)
+			run_size = size - done;
+
+		ssize_t n = run_rw(e->physical + skip, cluster_offset, (byte_t*) buf + done, run_size, write, &b);
+
+		if(n < 0)
+		{
+			res = n;
+			break;
+		}
+
+		done += n;
+		if(n < run_size)
+			break;
+
+		logical = e->logical + e->length;
+		cluster_offset = 0;
+	}
+
+	batch_submit(&b);
+
+	if(b.failed < done)
+		done = b.failed;
+
+	return (done == 0 && res < 0) ? res : done;
+}
+
+/* Extend chain up to need clusters */
+static int map_extend(dfat_file_t *f, cluster_t need)
+{
+	if(need <= f->clusters)
+		return 0;
+
+	struct dfat_extent *e = &f->extents[f->extents_count-1];
+	cluster_t last = e->physical + e->length - 1;
+	int res = dfat_extend_chain(last, need - f->clusters);
+
+	/* Map new part of chain, even if it was extended partially */
+	if(map_walk(f, FAT[last].index) < 0 || res < 0)
+		return -ENOSPC;
+
+	return 0;
+}
+
+/* Fill [from, to) of file by zeroes, chain must cover it */
+static int map_zero(dfat_file_t *f, off_t from, off_t to)
+{
+	size_t chunk = (size_t) MAP_BATCH*sinfo.cluster_size;
+	byte_t *zero = calloc(1, chunk);
+
+	if(zero == NULL)
+		return -ENOMEM;
+
+	while(from < to)
+	{
+		size_t n = (to - from < chunk) ? to - from : chunk;
+		ssize_t res = map_rw(f, from, zero, n, 1);
+
+		if(res <= 0)
+		{
+			free(zero);
+			return (res < 0) ? res : -EIO;
+		}
+		from += res;
+	}
+
+	free(zero);
+	return 0;
+}
+
+/* Open files */
+/******************************************************************************************/
+/* Shared object of file with record r at addr, called under file lock */
+static dfat_file_t *file_get(laddr_t addr, dir_record_t r)
+{
+	if(r.flags & 0x80)
+	{
+		dfat_file_unlock(r.index);
+		errno = EISDIR;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&files_lock);
+
+	dfat_file_t *f = files_find(addr);
+	if(f == NULL)
+	{
+		f = (dfat_file_t*) calloc(1, sizeof(dfat_file_t));
+		if(f == NULL)
+		{
+			pthread_mutex_unlock(&files_lock);
+			dfat_file_unlock(r.index);
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		f->addr = addr;
+		f->first = r.index;
+		pthread_mutex_init(&f->map_lock, NULL);
+		memcpy(&f->record, &r, sizeof(r));
+		files_insert(f);
+	}
+	f->refs++;
+
+	pthread_mutex_unlock(&files_lock);
+	dfat_file_unlock(r.index);
+
+	debug("dfat_open() %s at 0x%X refs %u\n", r.name, addr, f->refs);
+	return f;
+}
+
+dfat_file_t *dfat_open(const char *path)
+{
+	dir_record_t r;
+	laddr_t addr = dfat_lock_file(path, &r, 0);
+
+	if(addr == 0)
+	{
+		errno = ENOENT;
+		return NULL;
+	}
+
+	return file_get(addr, r);
+}
+
+/* Open file by record address, without path resolution */
+dfat_file_t *dfat_open_at(laddr_t addr)
+{
+	dir_record_t r;
+
+	if(dfat_read_record(addr, &r) < 0 || r.name[0] == 0x0)
+	{
+		errno = ENOENT;
+		return NULL;
+	}
+
+	cluster_t index = r.index;
+	dfat_file_rdlock(index);
+
+	/* Record could be deleted or moved before lock was taken */
+	char name[SIZE_NAME];
+	strcpy(name, r.name);
+	if(dfat_read_record(addr, &r) < 0 || r.index != index || strcmp(r.name, name) != 0)
+	{
+		dfat_file_unlock(index);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	return file_get(addr, r);
+}
+
+void dfat_release(dfat_file_t *f)
+{
+	pthread_mutex_lock(&files_lock);
+
+	int last = (--f->refs == 0);
+	if(last && !f->unlinked)
+		files_remove(f);
+
+	pthread_mutex_unlock(&files_lock);
+
+	if(!last)
+		return;
+
+	/* Clusters of unlinked file live until last handle is closed */
+	if(f->unlinked)
+		dfat_free_chain(f->first);
+
+	pthread_mutex_destroy(&f->map_lock);
+	free(f->extents);
+	free(f);
+}
+
+/* Record at addr is deleted. If file is open, chain freeing is deferred
+ * to the last release and 1 is returned. Called under file lock. */
+int dfat_file_unlinked(laddr_t addr)
+{
+	pthread_mutex_lock(&files_lock);
+
+	dfat_file_t *f = files_find(addr);
+	if(f != NULL)
+	{
+		files_remove(f);
+		f->unlinked = 1;
+	}
+
+	pthread_mutex_unlock(&files_lock);
+
+	return f != NULL;
+}
+
+/* Record moved from addr to naddr by rename. Called under file lock. */
+void dfat_file_moved(laddr_t addr, laddr_t naddr, const char *name)
+{
+	pthread_mutex_lock(&files_lock);
+
+	dfat_file_t *f = files_find(addr);
+	if(f != NULL)
+	{
+		files_remove(f);
+		f->addr = naddr;
+		memset(f->record.name, 0, sizeof(f->record.name));
+		strcpy(f->record.name, name);
+		files_insert(f);
+	}
+
+	pthread_mutex_unlock(&files_lock);
+}
+
+int dfat_file_read(dfat_file_t *f, void *buf, size_t size, off_t offset)
+{
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_READ);
+	dfat_file_rdlock(f->first);
+
+	if(offset >= f->record.size)
+	{
+		dfat_file_unlock(f->first);
+		dfat_stats_end(&t, 0);
+		return 0;
+	}
+
+	if(size > f->record.size - offset)
+		size = f->record.size - offset;
+
+	ssize_t b_off = map_load(f);
+	if(b_off == 0)
+		b_off = map_rw(f, offset, buf, size, 0);
+	dfat_file_unlock(f->first);
+
+	dfat_stats_end(&t, b_off);
+	dfat_trace(DFAT_TR_READ, offset, b_off);
+
+	debug("dfat_file_read() size=%u offset=%u b_off=%u\n\tfile size = %u\n",
+		size, offset, b_off, f->record.size);
+	return b_off;
+}
+
+static int file_write(dfat_file_t *f, const void *buf, size_t size, off_t offset)
+{
+	debug("dfat_file_write() size=%u offset=%u\n", size, offset);
+
+	dfat_file_wrlock(f->first);
+
+	if(map_load(f) < 0) {
+		dfat_file_unlock(f->first);
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+
+	/* Reserve the whole span of the write up front */
+	cluster_t need = (offset + size + sinfo.cluster_size - 1)/sinfo.cluster_size;
+
+	if(map_extend(f, need) < 0) {
+		dfat_file_unlock(f->first);
+		errno = ENOSPC;
+		return -ENOSPC;
+	}
+
+	/* Gap after end of file may hold stale or preallocated clusters */
+	if(offset > f->record.size && map_zero(f, f->record.size, offset) < 0) {
+		dfat_file_unlock(f->first);
+		errno = EIO;
+		return -EIO;
+	}
+
+	ssize_t b_off = map_rw(f, offset, (void*) buf, size, 1);
+	if(b_off < 0)
+	{
+		dfat_file_unlock(f->first);
+		return b_off;
+	}
+
+	dfat_file_changed(f->first);
+
+	/* File offset */
+	off_t f_off = offset + b_off;
+
+	if(f_off > f->record.size)
+	{
+		f->record.size = f_off;
+		if(!f->unlinked)
+			dfat_write_dir_record(f->addr, f->record);
+		debug("\twritig new record at address 0x%X, new file size %u\n", f->addr, f->record.size);
+	}
+
+	dfat_file_unlock(f->first);
+
+	debug("\twrited %zd Bytes\n", b_off);
+	dfat_trace(DFAT_TR_WRITE, offset, b_off);
+
+	int res = dfat_commit();
+	return (res < 0) ? res : b_off;
+}
+
+int dfat_file_write(dfat_file_t *f, const void *buf, size_t size, off_t offset)
+{
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_WRITE);
+	int res = file_write(f, buf, size, offset);
+	dfat_stats_end(&t, res);
+
+	return res;
+}
+
+/* Cut chain after length bytes or extend it by zeroes */
+/* FAT has no holes, so growing allocates and zeroes clusters; record is written once */
+int dfat_file_truncate(dfat_file_t *f, off_t length)
+{
+	debug("dfat_file_truncate() size=%u length=%u\n", f->record.size, length);
+
+	dfat_file_wrlock(f->first);
+
+	if(length == f->record.size)
+	{
+		dfat_file_unlock(f->first);
+		return 0;
+	}
+
+	if(map_load(f) < 0) {
+		dfat_file_unlock(f->first);
+		return -ENOMEM;
+	}
+
+	/* Clusters to keep, first cluster always stays with file */
+	cluster_t keep = (length + sinfo.cluster_size - 1)/sinfo.cluster_size;
+	if(keep == 0)
+		keep = 1;
+
+	if(length > f->record.size)
+	{
+		/* Tail of last cluster and new clusters may hold stale data */
+		int res = map_extend(f, keep);
+		if(res == 0)
+			res = map_zero(f, f->record.size, length);
+
+		if(res < 0)
+		{
+			dfat_file_unlock(f->first);
+			return res;
+		}
+	}
+	else if(keep < f->clusters)
+	{
+		int i = map_find(f, keep - 1);
+		struct dfat_extent *e = &f->extents[i];
+		cluster_t cluster = e->physical + (keep - 1 - e->logical);
+		cluster_t tail = FAT[cluster].index;
+
+		dfat_fat_lock();
+		dfat_fat_set(cluster, 0x1);
+		dfat_fat_unlock();
+		dfat_free_chain(tail);
+
+		/* Cut map after cluster */
+		e->length = keep - e->logical;
+		f->extents_count = i + 1;
+		f->clusters = keep;
+	}
+
+	dfat_file_changed(f->first);
+	dfat_trace(DFAT_TR_TRUNCATE, f->record.size, length);
+	f->record.size = length;
+	if(!f->unlinked)
+		dfat_write_dir_record(f->addr, f->record);
+
+	dfat_file_unlock(f->first);
+
+	return dfat_commit();
+}
+
+/* Preallocate [offset, offset+length) of file, chain is extended by
+ * contiguous runs where possible. DFAT_FALLOC_PUNCH_HOLE zeroes the range
+ * instead, FAT has no holes so clusters stay allocated. FAT has no
+ * unwritten extents either, so growing size would mean writing zeroes
+ * over the whole range: that mode fails with EOPNOTSUPP and callers fall
+ * back to their own zeroing, only DFAT_FALLOC_KEEP_SIZE preallocates. */
+int dfat_file_fallocate(dfat_file_t *f, int mode, off_t offset, off_t length)
+{
+	debug("dfat_file_fallocate() mode=%d offset=%u length=%u\n", mode, offset, length);
+
+	if(offset < 0 || length <= 0)
+		return -EINVAL;
+
+	if(mode & ~(DFAT_FALLOC_KEEP_SIZE | DFAT_FALLOC_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+
+	/* As in Linux, punching a hole never changes size */
+	if((mode & DFAT_FALLOC_PUNCH_HOLE) && !(mode & DFAT_FALLOC_KEEP_SIZE))
+		return -EOPNOTSUPP;
+
+	dfat_file_wrlock(f->first);
+
+	if(map_load(f) < 0) {
+		dfat_file_unlock(f->first);
+		return -ENOMEM;
+	}
+
+	off_t end = offset + length;
+	int res = 0;
+
+	if(mode & DFAT_FALLOC_PUNCH_HOLE)
+	{
+		if(end > f->record.size)
+			end = f->record.size;
+		if(offset < end && (res = map_zero(f, offset, end)) == 0)
+			dfat_file_changed(f->first);
+
+		dfat_file_unlock(f->first);
+		return (res < 0) ? res : dfat_commit();
+	}
+
+	if(!(mode & DFAT_FALLOC_KEEP_SIZE) && end > f->record.size)
+	{
+		dfat_file_unlock(f->first);
+		return -EOPNOTSUPP;
+	}
+
+	/* Clusters below size are always allocated */
+	if(mode & DFAT_FALLOC_KEEP_SIZE)
+		res = map_extend(f, (end + sinfo.cluster_size - 1)/sinfo.cluster_size);
+
+	dfat_file_unlock(f->first);
+
+	return (res < 0) ? res : dfat_commit();
+}
+
+/* Truncate by path, file is opened for the time of call */
+int dfat_truncate(const char *path, off_t length)
+{
+	dfat_file_t *f = dfat_open(path);
+
+	if(f == NULL)
+		return -errno;
+
+	int res = dfat_file_truncate(f, length);
+	dfat_release(f);
+
+	return res;
+}
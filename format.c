@@ -7,8 +7,6 @@
 
 #define DEBUG 1
 
-int get_file_size(int fd);
-
 int main(int argc, char** argv)
 {
 	struct superblock_info sinfo;
@@ -18,10 +16,12 @@ int main(int argc, char** argv)
 	sinfo.cluster_size = 1024;
 	sinfo.sector_size = 512;
 	sinfo.fat_size = 0x0;
+	sinfo.journal_size = DFAT_JOURNAL_SIZE;
 
 
 	if(argc<6 || !strcmp(argv[0], "--help")) {
-		printf("mkfs.dfat <device> -s <sector size> -c <cluster size> -n <label>\n");
+		printf("mkfs.dfat <device> -s <sector size> -c <cluster size> -n <label> [-j <journal size>]\n"
+		       "  -j 0 disables journal, file system is not crash consistent then\n");
 		return -1;
 	}
 	//reading arguments
@@ -41,6 +41,11 @@ int main(int argc, char** argv)
 		{
 			strcpy(sinfo.label, argv[++i]);
 		}
+
+		else if(strcmp("-j", argv[i]) == 0)
+		{
+			sscanf(argv[++i], "%u", &sinfo.journal_size);
+		}
 	}
 
 	#if DEBUG
@@ -50,42 +55,13 @@ int main(int argc, char** argv)
 	#endif
 
 		printf("Starting formating...\n");
-		
-		int fd = open(argv[1], O_WRONLY | O_CREAT);
-		if(fd == -1 ) {
-			perror("Device open error");
+
+		int res = dfat_format(argv[1], sinfo.sector_size, sinfo.cluster_size, sinfo.label, sinfo.journal_size);
+		if(res < 0) {
+			fprintf(stderr, "Format error: %s\n", strerror(-res));
 			return -2;
 		}
 
-		int n =   (get_file_size(fd) - sinfo.sector_size)/(sinfo.cluster_size + sizeof(struct fat_record));
-		printf("FAT size: %u B; FAT entries: %u\n", n*sizeof(struct fat_record), n);
-
-		int writed = 0x0;
-
-		printf("Writing superblock...\n");
-		sinfo.fat_size = n*sizeof(struct fat_record);
-		writed += write(fd, &sinfo, sizeof(sinfo));
-		/* Fill leave free space by null */
-		unsigned int null = 0x0;
-		while( writed < sinfo.sector_size )
-		      writed +=  write(fd, &null, sizeof(null));
-
-		printf("Writing inittialy FAT table\n");
-		struct fat_record fr;
-		fr.index = 1;
-		writed += write(fd, &fr, sizeof(fr));
-
-		printf("\t\tClearing file system...\n");
-		int size = get_file_size(fd);  
-		while( writed < size )
-		      writed +=  write(fd, &null, sizeof(null));
 		printf("Formated!\n\n");
-		return close(fd);
+		return 0;
 }
-
-int get_file_size(int fd) 
-{
-	struct stat buf;
-    fstat(fd, &buf);
-    return buf.st_size;
-}
\ No newline at end of file
@@ -1,218 +1,1192 @@
-#define _USE_GNU
-#define _POSIX_C_SOURCE 199309
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION  26
-#define USERDATA ((struct user_data*)(fuse_get_context()->private_data))
-#define LOGFILE USERDATA->logfile
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <dirent.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include "libdfat.h"
 
+/* Low-level FUSE front end */
+/* Node id is first cluster of file or folder: it is unique while file
+ * exists and stays the same on rename. Root folder (cluster 2) is
+ * FUSE_ROOT_ID. Node table keeps dir record address of every node known
+ * to kernel, so requests go to the record without path resolution. */
+
 /******************************************************/
-struct user_data {
-  FILE *logfile;
-};
 
-FILE* log_open()
+int dfuse_usage()
 {
-  FILE *logfile = fopen("fusedfat.log", "w");
-  setvbuf(logfile, NULL, _IOLBF, 0);;
-  return logfile;
+    printf("dfuse_fuse [-o cache_size=<clusters>] [-o sync=always|fsync|periodic]\n"
+           "           [-o sync_interval=<ms>] [-o backend=pread|mmap|mem|uring] [-o odirect]\n"
+           "           [-o attr_timeout=<s>] [-o entry_timeout=<s>] [-o direct_io_size=<MB>]\n"
+           "           [-o trace=<file>] [-o stats=<file>] [-o capture=<file>]\n"
+           "           <device> <mountpoint>\n\n");
+    return 0;
 }
 
-void log_msg(const char *format, ...)
+/* Mount options */
+struct dfuse_config {
+  unsigned int cache_size;
+  char *sync;
+  unsigned int sync_interval;
+  char *backend;
+  int odirect;
+  /* Seconds kernel may cache attributes and lookups */
+  double attr_timeout;
+  double entry_timeout;
+  /* Files of this size and bigger bypass page cache, 0 - never */
+  unsigned int direct_io_size;
+  /* Binary trace written at unmount, see tracedump */
+  char *trace;
+  /* Statistics report written at unmount, stderr if not set */
+  char *stats;
+  /* Every callback is recorded here, see dfat-replay */
+  char *capture;
+};
+
+static struct dfuse_config conf = { DFAT_CACHE_SIZE, NULL, DFAT_SYNC_INTERVAL, NULL, 0, 1.0, 1.0, 0, NULL, NULL, NULL };
+
+static struct fuse_opt dfuse_opts[] = {
+  { "cache_size=%u", offsetof(struct dfuse_config, cache_size), 0 },
+  { "sync=%s", offsetof(struct dfuse_config, sync), 0 },
+  { "sync_interval=%u", offsetof(struct dfuse_config, sync_interval), 0 },
+  { "backend=%s", offsetof(struct dfuse_config, backend), 0 },
+  { "odirect", offsetof(struct dfuse_config, odirect), 1 },
+  { "attr_timeout=%lf", offsetof(struct dfuse_config, attr_timeout), 0 },
+  { "entry_timeout=%lf", offsetof(struct dfuse_config, entry_timeout), 0 },
+  { "direct_io_size=%u", offsetof(struct dfuse_config, direct_io_size), 0 },
+  { "trace=%s", offsetof(struct dfuse_config, trace), 0 },
+  { "stats=%s", offsetof(struct dfuse_config, stats), 0 },
+  { "capture=%s", offsetof(struct dfuse_config, capture), 0 },
+  FUSE_OPT_END
+};
+
+static int dfuse_sync_mode(const char *name)
 {
-    va_list ap;
-    va_start(ap, format);
-    vfprintf( LOGFILE, format, ap);
-    fflush(LOGFILE);
+  if (name == NULL || strcmp(name, "fsync") == 0)
+    return DFAT_SYNC_FSYNC;
+  if (strcmp(name, "always") == 0)
+    return DFAT_SYNC_ALWAYS;
+  if (strcmp(name, "periodic") == 0)
+    return DFAT_SYNC_PERIODIC;
+  return -1;
 }
 
+/* Node table */
 /******************************************************/
+#define NODE_BUCKETS 4096
 
-int dfuse_usage()
+struct dfuse_node {
+  cluster_t cluster;
+  /* Dir record address */
+  laddr_t addr;
+  /* Lookups not forgotten by kernel */
+  unsigned long nlookup;
+  /* Change generation of file at last open */
+  unsigned long generation;
+  /* Path from root, kept only while capturing */
+  char *path;
+  struct dfuse_node *next;
+};
+
+static struct dfuse_node *nodes[NODE_BUCKETS];
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static fuse_ino_t node_ino(cluster_t cluster)
 {
-    printf("dfuse_fuse <device> <mountpoint>\n\n");
-    return 0;
+  return (cluster == 2) ? FUSE_ROOT_ID : cluster;
+}
+
+static cluster_t node_cluster(fuse_ino_t ino)
+{
+  return (ino == FUSE_ROOT_ID) ? 2 : ino;
+}
+
+static struct dfuse_node **node_find(cluster_t cluster)
+{
+  struct dfuse_node **p = &nodes[cluster % NODE_BUCKETS];
+
+  while (*p != NULL && (*p)->cluster != cluster)
+    p = &(*p)->next;
+
+  return p;
 }
 
-void *dfuse_init(struct fuse_conn_info *conn)
-{   
+/* Path of name in folder node, or of node itself if name is NULL. Return
+ * NULL if not capturing, empty path if node is unknown */
+static char *node_path(fuse_ino_t ino, const char *name, char *path)
+{
+  if (conf.capture == NULL)
     return NULL;
+
+  path[0] = 0;
+
+  if (ino != FUSE_ROOT_ID) {
+    pthread_mutex_lock(&nodes_lock);
+    struct dfuse_node *n = *node_find(node_cluster(ino));
+    if (n != NULL && n->path != NULL && strlen(n->path) < PATH_MAX)
+      strcpy(path, n->path);
+    pthread_mutex_unlock(&nodes_lock);
+
+    if (path[0] == 0)
+      return path;
+  }
+
+  /* Root is "/", names under it "/name" */
+  if (name == NULL && path[0] == 0)
+    strcpy(path, "/");
+  else if (name != NULL && strlen(path) + strlen(name) + 1 < PATH_MAX)
+    sprintf(path + strlen(path), "/%s", name);
+  else if (name != NULL)
+    path[0] = 0;
+
+  return path;
 }
 
-void dfuse_destroy(void *userdata)
+/* Node handed to kernel by lookup, create or mkdir, path is NULL unless capturing */
+static int node_ref(cluster_t cluster, laddr_t addr, const char *path)
 {
-    fflush(LOGFILE);
-    fclose(LOGFILE);
-    dfat_close();
+  pthread_mutex_lock(&nodes_lock);
+
+  struct dfuse_node **p = node_find(cluster);
+  if (*p == NULL) {
+    *p = calloc(1, sizeof(struct dfuse_node));
+    if (*p == NULL) {
+      pthread_mutex_unlock(&nodes_lock);
+      return -ENOMEM;
+    }
+    (*p)->cluster = cluster;
+  }
+  (*p)->addr = addr;
+  (*p)->nlookup++;
+
+  if (path != NULL && path[0] && ((*p)->path == NULL || strcmp((*p)->path, path) != 0)) {
+    free((*p)->path);
+    (*p)->path = strdup(path);
+  }
+
+  pthread_mutex_unlock(&nodes_lock);
+  return 0;
 }
 
-static int dfuse_getattr(const char *path, struct stat *stbuf)
+/* Record of node was moved by rename */
+static void node_moved(cluster_t cluster, laddr_t addr)
 {
+  pthread_mutex_lock(&nodes_lock);
 
-  int res = 0; /* temporary result */
-  memset(stbuf, 0, sizeof(struct stat));
+  struct dfuse_node **p = node_find(cluster);
+  if (*p != NULL)
+    (*p)->addr = addr;
+
+  pthread_mutex_unlock(&nodes_lock);
+}
+
+/* Paths of renamed node and nodes under it follow rename */
+static void node_renamed(const char *from, const char *to)
+{
+  size_t len = strlen(from);
+
+  pthread_mutex_lock(&nodes_lock);
+
+  for (unsigned int i = 0; i < NODE_BUCKETS; i++) {
+    for (struct dfuse_node *n = nodes[i]; n != NULL; n = n->next) {
+      if (n->path == NULL || strncmp(n->path, from, len) != 0 || (n->path[len] != 0 && n->path[len] != '/'))
+        continue;
+
+      char *path = malloc(strlen(to) + strlen(n->path + len) + 1);
+      if (path != NULL)
+        sprintf(path, "%s%s", to, n->path + len);
+      free(n->path);
+      n->path = path;
+    }
+  }
+
+  pthread_mutex_unlock(&nodes_lock);
+}
+
+/* File of node is opened at generation. Return 1 if it is unchanged since last open,
+ * so pages kernel cached for the node are still valid */
+static int node_opened(cluster_t cluster, unsigned long generation)
+{
+  int same = 0;
+
+  pthread_mutex_lock(&nodes_lock);
+
+  struct dfuse_node *n = *node_find(cluster);
+  if (n != NULL) {
+    same = (n->generation == generation);
+    n->generation = generation;
+  }
+
+  pthread_mutex_unlock(&nodes_lock);
+  return same;
+}
+
+static void node_forget(cluster_t cluster, unsigned long nlookup)
+{
+  pthread_mutex_lock(&nodes_lock);
+
+  struct dfuse_node **p = node_find(cluster);
+  struct dfuse_node *n = *p;
+  if (n != NULL && (n->nlookup -= (nlookup < n->nlookup) ? nlookup : n->nlookup) == 0) {
+    *p = n->next;
+    free(n->path);
+    free(n);
+  }
+
+  pthread_mutex_unlock(&nodes_lock);
+}
+
+/* Current record of node, root record is made up. Return record address, 0 if node is gone */
+static laddr_t node_record(fuse_ino_t ino, dir_record_t *r)
+{
+  cluster_t cluster = node_cluster(ino);
+
+  if (cluster == 2)
+    return dfat_find_dir_record("/", r);
+
+  pthread_mutex_lock(&nodes_lock);
+  struct dfuse_node *n = *node_find(cluster);
+  laddr_t addr = (n != NULL) ? n->addr : 0;
+  pthread_mutex_unlock(&nodes_lock);
+
+  /* Record could be deleted since lookup */
+  if (addr == 0 || dfat_read_record(addr, r) < 0 || r->name[0] == 0x0 || r->index != cluster)
+    return 0;
+
+  return addr;
+}
+
+/******************************************************/
+
+static void dfuse_stat(const dir_record_t *r, struct stat *st)
+{
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = node_ino(r->index);
+
+  if ((r->flags & 0x80)) {
+    st->st_mode = S_IFDIR | 0777;
+    st->st_nlink = 2;
+    st->st_size = 0;
+    st->st_blocks = dfat_total_space();
+    st->st_blksize = sinfo.cluster_size;
+  }
+  else {
+    st->st_mode = S_IFREG | 0777;
+    st->st_nlink = 1;
+    st->st_size = r->size;
+  }
+}
+
+static void dfuse_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+       laddr_t addr, const dir_record_t *r)
+{
+  struct fuse_entry_param e;
+  char path[PATH_MAX];
+  memset(&e, 0, sizeof(e));
+
+  if (node_ref(r->index, addr, node_path(parent, name, path)) < 0) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  e.ino = node_ino(r->index);
+  /* Node id is first cluster, which is reused after unlink */
+  e.generation = dfat_file_birth(r->index) + 1;
+  e.attr_timeout = conf.attr_timeout;
+  e.entry_timeout = conf.entry_timeout;
+  dfuse_stat(r, &e.attr);
+
+  fuse_reply_entry(req, &e);
+}
+
+/* Reply entry of just created name */
+static void dfuse_reply_created(fuse_req_t req, fuse_ino_t parent, const char *name, int res)
+{
   dir_record_t r;
+  laddr_t addr;
+
+  if (res < 0 || (addr = dfat_lookup(node_cluster(parent), name, &r)) == 0) {
+    fuse_reply_err(req, (res < 0) ? -res : EIO);
+    return;
+  }
+
+  dfuse_reply_entry(req, parent, name, addr, &r);
+}
+
+/* Page cache of file is kept across opens while file is unchanged,
+ * huge files may bypass it */
+static void dfuse_cache_policy(dfat_file_t *f, struct fuse_file_info *fi)
+{
+  fi->keep_cache = node_opened(f->first, dfat_file_generation(f->first));
+
+  if (conf.direct_io_size && f->record.size >= (off_t) conf.direct_io_size << 20)
+    fi->direct_io = 1;
+}
+
+#define FILE_HANDLE(fi) ((dfat_file_t*)(uintptr_t)(fi)->fh)
+
+/* Virtual stats file */
+/******************************************************/
+/* /.dfat/stats is read-only report of dfat_stats_format(), taken at open.
+ * Its inodes follow the last cluster, so they never meet a file, and
+ * ".dfat" in root folder is hidden by it. */
+#define STATS_DIR ".dfat"
+#define STATS_FILE "stats"
+
+struct dfuse_report {
+  char *data;
+  size_t size;
+};
+
+static fuse_ino_t stats_dir_ino()
+{
+  return (fuse_ino_t) fat_count + 2;
+}
+
+static fuse_ino_t stats_file_ino()
+{
+  return (fuse_ino_t) fat_count + 3;
+}
 
-  if( !dfat_find_dir_record(path, &r) )
-    return -ENOENT;
+static int dfuse_virtual(fuse_ino_t ino)
+{
+  return ino == stats_dir_ino() || ino == stats_file_ino();
+}
+
+#define REPORT_HANDLE(fi) ((struct dfuse_report*)(uintptr_t)(fi)->fh)
 
-  if( (r.flags & 0x80) ) {
-    stbuf->st_mode = 0x4000 | 0777;
-    stbuf->st_size = 0;
-    stbuf->st_blocks = dfat_total_space();
-    stbuf->st_blksize = sinfo.cluster_size;
+/* Size is unknown before open, report is read with direct_io */
+static void stats_stat(fuse_ino_t ino, struct stat *st)
+{
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = ino;
+
+  if (ino == stats_dir_ino()) {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
   }
   else {
-    stbuf->st_mode = 0x8000 | 0777;
-    stbuf->st_size = r.size;
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+  }
+}
+
+/* Return 1 if name is virtual and lookup was answered */
+static int stats_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+
+  if (parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR) == 0)
+    e.ino = stats_dir_ino();
+  else if (parent == stats_dir_ino() && strcmp(name, STATS_FILE) == 0)
+    e.ino = stats_file_ino();
+  else if (parent == stats_dir_ino()) {
+    fuse_reply_err(req, ENOENT);
+    return 1;
   }
+  else
+    return 0;
 
-  return 0;
+  e.generation = 1;
+  e.attr_timeout = conf.attr_timeout;
+  e.entry_timeout = conf.entry_timeout;
+  stats_stat(e.ino, &e.attr);
+
+  fuse_reply_entry(req, &e);
+  return 1;
 }
 
-static int dfuse_error(char *str)
+/* Report text, NULL if out of memory */
+static char *stats_report(size_t *len)
 {
-    int ret = -errno;
-    log_msg("    ERROR %s: %s\n", str, strerror(errno));
-    return ret;
+  size_t size = dfat_stats_format(NULL, 0) + 1;
+  char *data = malloc(size);
+
+  if (data != NULL) {
+    /* Counters may widen between two calls, tail is cut then */
+    *len = dfat_stats_format(data, size);
+    if (*len >= size)
+      *len = size - 1;
+  }
+
+  return data;
 }
 
-int dfuse_mkdir(const char *path, mode_t mode)
+static void stats_open(fuse_req_t req, struct fuse_file_info *fi)
 {
-    debug("* dfuse_mkdir(path=\"%s\", mode=0%3o)\n", path, mode);
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  struct dfuse_report *rep = malloc(sizeof(struct dfuse_report));
+  if (rep == NULL || (rep->data = stats_report(&rep->size)) == NULL) {
+    free(rep);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  fi->fh = (uintptr_t) rep;
+  fi->direct_io = 1;
 
-    return dfat_create(path, 0x80, NULL);
+  if (fuse_reply_open(req, fi) < 0) {
+    free(rep->data);
+    free(rep);
+  }
 }
 
-int dfuse_unlink(const char *path)
+static void stats_read(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int retstat = 0;
+  struct dfuse_report *rep = REPORT_HANDLE(fi);
 
-    debug("* dfuse_unlink(path=\"%s\")\n", path);
+  if (offset >= rep->size)
+    fuse_reply_buf(req, NULL, 0);
+  else
+    fuse_reply_buf(req, rep->data + offset, (size < rep->size - offset) ? size : rep->size - offset);
+}
 
-    retstat = dfat_unlink(path);
+static void stats_release(struct fuse_file_info *fi)
+{
+  free(REPORT_HANDLE(fi)->data);
+  free(REPORT_HANDLE(fi));
+}
 
-    if (retstat < 0)
+static void stats_readdir(fuse_req_t req, size_t size, off_t offset)
+{
+  char buf[256];
+  struct stat st;
+  size_t used = 0;
 
-    retstat = dfuse_error("unlink");
+  stats_stat(stats_file_ino(), &st);
+  if (offset == 0) {
+    used = fuse_add_direntry(req, buf, sizeof(buf), STATS_FILE, &st, 1);
+    if (used > size)
+      used = 0;
+  }
 
-    return retstat;
+  fuse_reply_buf(req, buf, used);
 }
 
-int dfuse_rmdir(const char *path)
+/* Report of mount, written at unmount */
+static void stats_dump()
 {
-    int retstat = 0;
-    debug("* dfuse_rmdir(path=\"%s\")\n", path);
-    return dfat_rmdir(path);
+  size_t len;
+  char *data = stats_report(&len);
+  if (data == NULL)
+    return;
+
+  FILE *out = (conf.stats != NULL) ? fopen(conf.stats, "w") : stderr;
+  if (out == NULL)
+    error("* stats_dump() %s: %s\n", conf.stats, strerror(errno));
+  else {
+    fputs(data, out);
+    if (out != stderr)
+      fclose(out);
+  }
+
+  free(data);
 }
 
-int dfuse_rename(const char *path, const char *newpath)
+/* Operations */
+/******************************************************/
+static void dfuse_destroy(void *userdata)
 {
-    return dfat_rename(path, newpath);
+  stats_dump();
+  dfat_close();
+
+  if (conf.capture != NULL)
+    dfat_capture_stop();
+
+  if (conf.trace != NULL) {
+    dfat_trace_stop();
+    long count = dfat_trace_dump(conf.trace);
+    if (count < 0)
+      error("* dfuse_destroy() trace %s: %s\n", conf.trace, strerror(-count));
+  }
 }
 
-int dfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
-{  
+static void dfuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  debug("* dfuse_lookup() %lu/%s\n", parent, name);
 
-  debug("* dfuse_create() %s\n", path);
-  return dfat_create(path, 0x0, NULL);
+  if (stats_lookup(req, parent, name))
+    return;
+
+  dir_record_t r;
+  laddr_t addr = dfat_lookup(node_cluster(parent), name, &r);
+
+  if (addr == 0) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  dfuse_reply_entry(req, parent, name, addr, &r);
+}
+
+static void dfuse_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  node_forget(node_cluster(ino), nlookup);
+  fuse_reply_none(req);
 }
 
-int dfuse_open(const char *path, struct fuse_file_info *fi)
+static void dfuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  if(!dfat_exist(path)) 
-  {
-    if(fi->flags & O_CREAT)
-    {
-      debug("* dfuse_open() creating file\n");    
-      dfat_create(path, 0x0, NULL);
-      return 0;
+  struct stat st;
+  dir_record_t r;
+
+  if (dfuse_virtual(ino)) {
+    stats_stat(ino, &st);
+    fuse_reply_attr(req, &st, conf.attr_timeout);
+    return;
+  }
+
+  /* Record of open file may be already deleted */
+  if (fi != NULL && fi->fh)
+    memcpy(&r, &FILE_HANDLE(fi)->record, sizeof(r));
+  else if (!node_record(ino, &r)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  dfuse_stat(&r, &st);
+  fuse_reply_attr(req, &st, conf.attr_timeout);
+}
+
+/* Only size can be changed, other attributes are fixed */
+static void dfuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+       struct fuse_file_info *fi)
+{
+  debug("* dfuse_setattr() %lu to_set 0x%X\n", ino, to_set);
+
+  if (dfuse_virtual(ino)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  if ((to_set & FUSE_SET_ATTR_SIZE)) {
+    dir_record_t r;
+    dfat_file_t *f = (fi != NULL && fi->fh) ? FILE_HANDLE(fi) : NULL;
+
+    if (f == NULL) {
+      laddr_t addr = node_record(ino, &r);
+      if (addr == 0 || (f = dfat_open_at(addr)) == NULL) {
+        fuse_reply_err(req, addr ? errno : ENOENT);
+        return;
+      }
+    }
+
+    int res = dfat_file_truncate(f, attr->st_size);
+
+    if (f != ((fi != NULL && fi->fh) ? FILE_HANDLE(fi) : NULL))
+      dfat_release(f);
+
+    if (res < 0) {
+      fuse_reply_err(req, -res);
+      return;
     }
-    error("* dfuse_open() file not exists\n");
-    return -ENOENT;
   }
-  debug("* dfuse_open() %s: flags 0x%X\n", path, fi->flags);
-  return 0;
+
+  dfuse_getattr(req, ino, fi);
+}
+
+static void dfuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  debug("* dfuse_mkdir() %lu/%s, mode=0%3o\n", parent, name, mode);
+
+  if (dfuse_virtual(parent)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  int res = dfat_create_at(node_cluster(parent), name, 0x80, NULL);
+  dfuse_reply_created(req, parent, name, res);
 }
 
-int dfuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static void dfuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-  debug("* dfuse_read() %s\n", path);
-  int readed = dfat_read(path, buf, size, offset);
-  return readed;
+  debug("* dfuse_unlink() %lu/%s\n", parent, name);
+  fuse_reply_err(req, dfuse_virtual(parent) ? EPERM : -dfat_unlink_at(node_cluster(parent), name));
 }
 
-int dfuse_write(const char *path, const char *buf, size_t size, off_t offset,
+static void dfuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  debug("* dfuse_rmdir() %lu/%s\n", parent, name);
+  fuse_reply_err(req, dfuse_virtual(parent) ? EPERM : -dfat_rmdir_at(node_cluster(parent), name));
+}
+
+static void dfuse_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+       fuse_ino_t newparent, const char *newname)
+{
+  debug("* dfuse_rename() %lu/%s -> %lu/%s\n", parent, name, newparent, newname);
+
+  if (dfuse_virtual(parent) || dfuse_virtual(newparent)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  int res = dfat_rename_at(node_cluster(parent), name, node_cluster(newparent), newname);
+
+  if (res == 0) {
+    dir_record_t r;
+    laddr_t addr = dfat_lookup(node_cluster(newparent), newname, &r);
+    if (addr)
+      node_moved(r.index, addr);
+
+    char from[PATH_MAX], to[PATH_MAX];
+    if (node_path(parent, name, from) && from[0] && node_path(newparent, newname, to) && to[0])
+      node_renamed(from, to);
+  }
+
+  fuse_reply_err(req, -res);
+}
+
+static void dfuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  if (ino == stats_file_ino()) {
+    stats_open(req, fi);
+    return;
+  }
+
+  dir_record_t r;
+  laddr_t addr = node_record(ino, &r);
+  dfat_file_t *f = addr ? dfat_open_at(addr) : NULL;
+
+  if (f == NULL) {
+    error("* dfuse_open() %lu: %s\n", ino, strerror(addr ? errno : ENOENT));
+    fuse_reply_err(req, addr ? errno : ENOENT);
+    return;
+  }
+
+  debug("* dfuse_open() %s: flags 0x%X\n", r.name, fi->flags);
+  fi->fh = (uintptr_t) f;
+  dfuse_cache_policy(f, fi);
+
+  /* Interrupted open is released here */
+  if (fuse_reply_open(req, fi) < 0)
+    dfat_release(f);
+}
+
+static void dfuse_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
        struct fuse_file_info *fi)
 {
-  debug("* dfuse_write() %s\n", path);
-  int writed = dfat_write(path, buf, size, offset);;
-  return writed;
+  debug("* dfuse_create() %lu/%s\n", parent, name);
+
+  if (dfuse_virtual(parent)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  dir_record_t r;
+  laddr_t addr = 0;
+  dfat_file_t *f = NULL;
+  int res = dfat_create_at(node_cluster(parent), name, 0x0, NULL);
+
+  if (res == 0 && (addr = dfat_lookup(node_cluster(parent), name, &r)) != 0)
+    f = dfat_open_at(addr);
+
+  if (f == NULL) {
+    fuse_reply_err(req, (res < 0) ? -res : (addr ? errno : EIO));
+    return;
+  }
+
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = node_ino(r.index);
+  /* Node id is first cluster, which is reused after unlink */
+  e.generation = dfat_file_birth(r.index) + 1;
+  e.attr_timeout = conf.attr_timeout;
+  e.entry_timeout = conf.entry_timeout;
+  dfuse_stat(&r, &e.attr);
+
+  fi->fh = (uintptr_t) f;
+
+  char path[PATH_MAX];
+  if (node_ref(r.index, addr, node_path(parent, name, path)) < 0) {
+    dfat_release(f);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  dfuse_cache_policy(f, fi);
+
+  if (fuse_reply_create(req, &e, fi) < 0)
+    dfat_release(f);
 }
 
-int dfuse_truncate (const char *path, off_t offset)
+static void dfuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  debug("* dfuse_release() %lu\n", ino);
+
+  if (ino == stats_file_ino())
+    stats_release(fi);
+  else
+    dfat_release(FILE_HANDLE(fi));
+  fuse_reply_err(req, 0);
+}
+
+/* close(): synced only in always mode, otherwise durability is left to
+ * fsync or periodic commit, so closing many files costs no device sync */
+static void dfuse_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  debug("* dfuse_flush() %lu\n", ino);
+
+  if (dfat_sync_mode() == DFAT_SYNC_ALWAYS)
+    fuse_reply_err(req, -dfat_sync());
+  else
+    fuse_reply_err(req, 0);
+}
+
+static void dfuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+  debug("* dfuse_fsync() %lu\n", ino);
+  /* File size and chain live in dir record and FAT, so datasync syncs them too */
+  fuse_reply_err(req, -dfat_sync());
+}
+
+static void dfuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+       struct fuse_file_info *fi)
+{
+  debug("* dfuse_read() %lu\n", ino);
+
+  if (ino == stats_file_ino()) {
+    stats_read(req, size, offset, fi);
+    return;
+  }
+
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  int readed = dfat_file_read(FILE_HANDLE(fi), buf, size, offset);
+
+  if (readed < 0)
+    fuse_reply_err(req, -readed);
+  else
+    fuse_reply_buf(req, buf, readed);
+
+  free(buf);
+}
+
+static void dfuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+       struct fuse_file_info *fi)
 {
-  debug("* dfuse_truncate() %s\n", path);
-  dfat_unlink(path);
-  dfat_create(path, 0x0, NULL);
+  debug("* dfuse_write() %lu\n", ino);
+  int writed = dfat_file_write(FILE_HANDLE(fi), buf, size, offset);
+
+  if (writed < 0)
+    fuse_reply_err(req, -writed);
+  else
+    fuse_reply_write(req, writed);
+}
+
+static void dfuse_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+       struct fuse_file_info *fi)
+{
+  debug("* dfuse_fallocate() %lu\n", ino);
+  fuse_reply_err(req, -dfat_file_fallocate(FILE_HANDLE(fi), mode, offset, length));
+}
+
+struct dfuse_dirbuf {
+  fuse_req_t req;
+  char *buf;
+  size_t size;
+  size_t used;
+};
+
+static int dfuse_fill(void *ctx, const dir_record_t *r, off_t next)
+{
+  struct dfuse_dirbuf *d = ctx;
+  struct stat st;
+
+  /* Inode and type only, attributes come by lookup */
+  memset(&st, 0, sizeof(st));
+  st.st_ino = node_ino(r->index);
+  st.st_mode = (r->flags & 0x80) ? S_IFDIR : S_IFREG;
+
+  size_t n = fuse_add_direntry(d->req, d->buf + d->used, d->size - d->used, r->name, &st, next);
+  if (n > d->size - d->used)
+    return 1;
+
+  d->used += n;
   return 0;
 }
 
+/* Records go to reply buffer directly, offset resumes listing of big folders */
+static void dfuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+       struct fuse_file_info *fi)
+{
+  debug("* dfuse_readdir() %lu offset %ld\n", ino, (long) offset);
+
+  if (ino == stats_dir_ino()) {
+    stats_readdir(req, size, offset);
+    return;
+  }
+
+  struct dfuse_dirbuf d = { req, malloc(size), size, 0 };
+  if (d.buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  int res = dfat_readdir(node_cluster(ino), offset, dfuse_fill, &d);
+
+  if (res < 0)
+    fuse_reply_err(req, -res);
+  else
+    fuse_reply_buf(req, d.buf, d.used);
+
+  free(d.buf);
+}
+
+/* Workload capture */
+/******************************************************/
+/* With capture=<file> session runs capture_oper: every callback is timed
+ * around the operation, reply included, and recorded with path of its
+ * node, resolved from node table. Virtual stats nodes are not recorded. */
+
+struct dfuse_capture {
+  int skip;
+  struct dfat_capture_record r;
+  char path[PATH_MAX];
+  char path2[PATH_MAX];
+};
+
+static void capture_begin(struct dfuse_capture *c, int op, fuse_ino_t ino, const char *name)
+{
+  c->skip = dfuse_virtual(ino);
+  memset(&c->r, 0, sizeof(c->r));
+  c->r.op = op;
+  c->path2[0] = 0;
+  node_path(ino, name, c->path);
+  c->r.start = dfat_capture_clock();
+}
 
-int dfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-               struct fuse_file_info *fi)
+static void capture_end(struct dfuse_capture *c, struct fuse_file_info *fi, uint64_t offset,
+       uint64_t size, uint32_t flags)
 {
+  if (c->skip)
+    return;
+
+  uint64_t ns = dfat_capture_clock() - c->r.start;
+  c->r.duration = (ns < UINT32_MAX) ? ns : UINT32_MAX;
+  c->r.fh = (fi != NULL) ? fi->fh : 0;
+  c->r.offset = offset;
+  c->r.size = size;
+  c->r.flags = flags;
+  dfat_capture(&c->r, c->path, (c->r.op == DFAT_CAP_RENAME) ? c->path2 : NULL);
+}
 
-    debug("* dfuse_readdir() %s\n", path);
+static void capture_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct dfuse_capture c;
 
-    int retstat = 0;
-    struct list l;
-    list_clear(&l);
-    dfat_read_folder_by_path(path, &l);
+  capture_begin(&c, DFAT_CAP_LOOKUP, parent, name);
+  dfuse_lookup(req, parent, name);
+  capture_end(&c, NULL, 0, 0, 0);
+}
 
-    for(unsigned int i=0; i<l.count; i++) {
-        filler(buf, l.array[i].name , NULL, 0);
-    }
-    return retstat;
+static void capture_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  struct dfuse_capture c;
+
+  /* Path is taken before node may be dropped */
+  capture_begin(&c, DFAT_CAP_FORGET, ino, NULL);
+  dfuse_forget(req, ino, nlookup);
+  capture_end(&c, NULL, 0, nlookup, 0);
+}
+
+static void capture_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_GETATTR, ino, NULL);
+  dfuse_getattr(req, ino, fi);
+  capture_end(&c, fi, 0, 0, 0);
+}
+
+static void capture_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+       struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_SETATTR, ino, NULL);
+  dfuse_setattr(req, ino, attr, to_set, fi);
+  capture_end(&c, fi, 0, attr->st_size, (to_set & FUSE_SET_ATTR_SIZE) != 0);
+}
+
+static void capture_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_MKDIR, parent, name);
+  dfuse_mkdir(req, parent, name, mode);
+  capture_end(&c, NULL, 0, 0, 0);
+}
+
+static void capture_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_UNLINK, parent, name);
+  dfuse_unlink(req, parent, name);
+  capture_end(&c, NULL, 0, 0, 0);
+}
+
+static void capture_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_RMDIR, parent, name);
+  dfuse_rmdir(req, parent, name);
+  capture_end(&c, NULL, 0, 0, 0);
+}
+
+static void capture_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+       fuse_ino_t newparent, const char *newname)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_RENAME, parent, name);
+  node_path(newparent, newname, c.path2);
+  dfuse_rename(req, parent, name, newparent, newname);
+  capture_end(&c, NULL, 0, 0, 0);
+}
+
+static void capture_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_OPEN, ino, NULL);
+  dfuse_open(req, ino, fi);
+  capture_end(&c, fi, 0, 0, fi->flags);
+}
+
+static void capture_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+       struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_CREATE, parent, name);
+  dfuse_create(req, parent, name, mode, fi);
+  capture_end(&c, fi, 0, 0, fi->flags);
+}
+
+static void capture_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+       struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_READ, ino, NULL);
+  dfuse_read(req, ino, size, offset, fi);
+  capture_end(&c, fi, offset, size, 0);
+}
+
+static void capture_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+       struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_WRITE, ino, NULL);
+  dfuse_write(req, ino, buf, size, offset, fi);
+  capture_end(&c, fi, offset, size, 0);
+}
+
+static void capture_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_FLUSH, ino, NULL);
+  dfuse_flush(req, ino, fi);
+  capture_end(&c, fi, 0, 0, 0);
+}
+
+static void capture_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_RELEASE, ino, NULL);
+  dfuse_release(req, ino, fi);
+  capture_end(&c, fi, 0, 0, 0);
+}
+
+static void capture_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_FSYNC, ino, NULL);
+  dfuse_fsync(req, ino, datasync, fi);
+  capture_end(&c, fi, 0, 0, datasync);
+}
+
+static void capture_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+       struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_READDIR, ino, NULL);
+  dfuse_readdir(req, ino, size, offset, fi);
+  capture_end(&c, NULL, offset, size, 0);
+}
+
+static void capture_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+       struct fuse_file_info *fi)
+{
+  struct dfuse_capture c;
+
+  capture_begin(&c, DFAT_CAP_FALLOCATE, ino, NULL);
+  dfuse_fallocate(req, ino, mode, offset, length, fi);
+  capture_end(&c, fi, offset, length, mode);
 }
 
 /******************************************************************/
 /* The fuse struct for storing FS operations functions addresses */
-struct fuse_operations dfuse_oper = {
+static struct fuse_lowlevel_ops dfuse_oper = {
+  .destroy = dfuse_destroy,
+  .lookup = dfuse_lookup,
+  .forget = dfuse_forget,
   .getattr = dfuse_getattr,
+  .setattr = dfuse_setattr,
   .mkdir = dfuse_mkdir,
   .unlink = dfuse_unlink,
-  .readdir = dfuse_readdir,
   .rmdir = dfuse_rmdir,
   .rename = dfuse_rename,
   .open = dfuse_open,
   .read = dfuse_read,
   .write = dfuse_write,
-  .destroy = dfuse_destroy,
+  .flush = dfuse_flush,
+  .release = dfuse_release,
+  .fsync = dfuse_fsync,
+  .readdir = dfuse_readdir,
   .create = dfuse_create,
-  .truncate = dfuse_truncate,
+  .fallocate = dfuse_fallocate,
+};
+
+static struct fuse_lowlevel_ops capture_oper = {
+  .destroy = dfuse_destroy,
+  .lookup = capture_lookup,
+  .forget = capture_forget,
+  .getattr = capture_getattr,
+  .setattr = capture_setattr,
+  .mkdir = capture_mkdir,
+  .unlink = capture_unlink,
+  .rmdir = capture_rmdir,
+  .rename = capture_rename,
+  .open = capture_open,
+  .read = capture_read,
+  .write = capture_write,
+  .flush = capture_flush,
+  .release = capture_release,
+  .fsync = capture_fsync,
+  .readdir = capture_readdir,
+  .create = capture_create,
+  .fallocate = capture_fallocate,
 };
 
+/* Relative path of option is resolved against working folder at start */
+static int dfuse_abspath(char **path)
+{
+    if (*path == NULL || (*path)[0] == '/')
+        return 0;
+
+    char *cwd = getcwd(NULL, 0);
+    char *abs = malloc((cwd ? strlen(cwd) : 0) + strlen(*path) + 2);
+    if (cwd == NULL || abs == NULL) {
+        free(cwd);
+        free(abs);
+        return -1;
+    }
+
+    sprintf(abs, "%s/%s", cwd, *path);
+    free(cwd);
+    free(*path);
+    *path = abs;
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     if ((argc < 3))
         return dfuse_usage();
 
-    struct user_data *data = (struct user_data*) malloc(sizeof(struct user_data));
-    data->logfile = log_open();
-
-    dfat_load(argv[argc-2]);
+    /* Daemon changes working folder */
+    char *device = realpath(argv[argc-2], NULL);
+    if (device == NULL) {
+        perror(argv[argc-2]);
+        return 1;
+    }
 
     argv[argc-2] = argv[argc-1];
     argv[argc-1] = NULL;
     argc--;
 
-    return fuse_main(argc, argv, &dfuse_oper, data);  
-}
\ No newline at end of file
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &conf, dfuse_opts, NULL) < 0)
+        return dfuse_usage();
+
+    int mode = dfuse_sync_mode(conf.sync);
+    if (mode < 0)
+        return dfuse_usage();
+
+    if (conf.backend != NULL && dfat_set_backend(conf.backend) < 0)
+        return dfuse_usage();
+
+    dfat_set_cache_size(conf.cache_size);
+    dfat_set_sync_mode(mode, conf.sync_interval);
+    dfat_set_direct(conf.odirect);
+
+    /* Trace, stats and capture are written after daemon changed working folder */
+    if (dfuse_abspath(&conf.trace) < 0 || dfuse_abspath(&conf.stats) < 0 ||
+        dfuse_abspath(&conf.capture) < 0)
+        return 1;
+
+    char *mountpoint;
+    int multithreaded, foreground;
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) < 0 || mountpoint == NULL)
+        return dfuse_usage();
+
+    int err = -1, res;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+
+    if (ch != NULL) {
+        struct fuse_lowlevel_ops *oper = (conf.capture != NULL) ? &capture_oper : &dfuse_oper;
+        struct fuse_session *se = fuse_lowlevel_new(&args, oper, sizeof(*oper), NULL);
+
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) == 0) {
+                fuse_session_add_chan(se, ch);
+
+                /* Sync thread must be started in daemon process */
+                fuse_daemonize(foreground);
+                if (conf.trace != NULL)
+                    dfat_trace_start();
+                if (conf.capture != NULL && (res = dfat_capture_start(conf.capture)) < 0)
+                    error("* main() capture %s: %s\n", conf.capture, strerror(-res));
+                else if (dfat_load(device) == 0)
+                    err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+
+    fuse_opt_free_args(&args);
+    free(device);
+
+    return err ? 1 : 0;
+}
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Metadata write-ahead log */
+/* Region between FAT and clusters: header sector, then transactions.
+ * FAT changes, dir records and cleared folder clusters are collected in
+ * pending batch and appended by one write at commit. Dirty cached clusters
+ * are written in place only after the batch is committed, FAT - only at
+ * checkpoint, which also empties the journal. Mount replays committed
+ * transactions on top of FAT written by last checkpoint. Freed clusters
+ * are allocated again only after their free is committed, see bitmap.c.
+ * Without journal FAT goes in place at checkpoint only, such file system
+ * is not crash consistent. */
+
+#define JOURNAL_MAGIC 0x4C4E524A
+
+/* FAT[cluster+i] = cluster+i+1, last one = value */
+#define JOURNAL_FAT_LINK 1
+/* FAT[cluster+i] = 0 */
+#define JOURNAL_FAT_FREE 2
+/* dir_record_t at value offset of cluster follows entry */
+#define JOURNAL_RECORD   3
+/* Cluster filled by zeroes */
+#define JOURNAL_ZERO     4
+
+struct journal_header {
+	unsigned int magic;
+	/* Sequence number of first transaction */
+	unsigned int seq;
+};
+
+struct journal_tx {
+	unsigned int magic;
+	unsigned int seq;
+	/* Entries size in bytes */
+	unsigned int size;
+	unsigned int checksum;
+};
+
+struct journal_entry {
+	unsigned int type;
+	cluster_t cluster;
+	cluster_t count;
+	cluster_t value;
+};
+
+static int enabled;
+static laddr_t journal_start;
+static laddr_t journal_end;
+/* Append position for next transaction */
+static laddr_t tail;
+static unsigned int seq;
+
+/* Pending batch, bytes [committed, appended) of all journaled entries */
+static byte_t *pending;
+static size_t pending_size;
+static size_t pending_capacity;
+static unsigned long long appended;
+static unsigned long long committed;
+/* Offset of last FAT entry in pending for merging, -1 if other entry is last */
+static long last_fat = -1;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int journal_checksum(unsigned int s, const byte_t *data, size_t size)
+{
+	unsigned int h = 2166136261u ^ s;
+
+	for(size_t i = 0; i < size; i++)
+	{
+		h ^= data[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* Transaction takes whole sectors */
+static size_t tx_length(size_t size)
+{
+	size += sizeof(struct journal_tx);
+
+	return (size + sinfo.sector_size - 1)/sinfo.sector_size*sinfo.sector_size;
+}
+
+static laddr_t journal_addr()
+{
+	return sinfo.sector_size + sinfo.fat_size;
+}
+
+static int journal_write_header()
+{
+	struct journal_header h = { JOURNAL_MAGIC, seq };
+
+	if( backend->write_at(&h, sizeof(h), journal_addr()) < (ssize_t) sizeof(h) || backend->sync() < 0 )
+	{
+		error("journal_write_header() %s\n", strerror(errno));
+		return -1;
+	}
+
+	tail = journal_start;
+	return 0;
+}
+
+static int pending_reserve(size_t size)
+{
+	if(pending_size + size <= pending_capacity)
+		return 0;
+
+	size_t capacity = pending_capacity ? pending_capacity*2 : 4096;
+	while(capacity < pending_size + size)
+		capacity *= 2;
+
+	byte_t *p = realloc(pending, capacity);
+	if(p == NULL)
+		return -ENOMEM;
+
+	pending = p;
+	pending_capacity = capacity;
+	return 0;
+}
+
+static void pending_append(const struct journal_entry *e, const void *data, size_t size)
+{
+	if( pending_reserve(sizeof(*e) + size) < 0 )
+	{
+		/* Entry is lost, checkpoint still writes it in place */
+		error("journal: can't grow pending batch\n");
+		return;
+	}
+
+	memcpy(pending + pending_size, e, sizeof(*e));
+	if(size)
+		memcpy(pending + pending_size + sizeof(*e), data, size);
+
+	pending_size += sizeof(*e) + size;
+	appended += sizeof(*e) + size;
+}
+
+/* FAT record of cluster is set to next, called under fat lock. Return mark
+ * of change: it is durable when dfat_journal_committed() reaches mark.
+ * Without journal only marks are counted, they are durable at checkpoint */
+unsigned long long dfat_journal_fat(cluster_t cluster, cluster_t next)
+{
+	unsigned long long mark;
+
+	pthread_mutex_lock(&journal_lock);
+
+	if(!enabled)
+	{
+		mark = ++appended;
+		pthread_mutex_unlock(&journal_lock);
+		return mark;
+	}
+
+	/* Allocation links runs and freeing walks them in order, merge them */
+	if(last_fat >= 0)
+	{
+		struct journal_entry *e = (struct journal_entry*)(pending + last_fat);
+
+		if(e->cluster + e->count == cluster)
+		{
+			if(e->type == JOURNAL_FAT_LINK && e->value == cluster && next != 0)
+			{
+				e->count++;
+				e->value = next;
+				mark = appended;
+				pthread_mutex_unlock(&journal_lock);
+				return mark;
+			}
+
+			if(e->type == JOURNAL_FAT_FREE && next == 0)
+			{
+				e->count++;
+				mark = appended;
+				pthread_mutex_unlock(&journal_lock);
+				return mark;
+			}
+		}
+	}
+
+	struct journal_entry e = { next ? JOURNAL_FAT_LINK : JOURNAL_FAT_FREE, cluster, 1, next };
+	long offset = pending_size;
+
+	pending_append(&e, NULL, 0);
+	last_fat = (pending_size > offset) ? offset : -1;
+	mark = appended;
+
+	pthread_mutex_unlock(&journal_lock);
+	return mark;
+}
+
+/* Dir record r was written at addr */
+void dfat_journal_record(laddr_t addr, const dir_record_t *r)
+{
+	if(!enabled)
+		return;
+
+	cluster_t cluster = dfat_addr_cluster(addr);
+	struct journal_entry e = { JOURNAL_RECORD, cluster, 1, addr - dfat_cluster_offset(cluster) };
+
+	pthread_mutex_lock(&journal_lock);
+	pending_append(&e, r, sizeof(dir_record_t));
+	last_fat = -1;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* Folder cluster was cleared */
+void dfat_journal_zero(cluster_t cluster)
+{
+	if(!enabled)
+		return;
+
+	struct journal_entry e = { JOURNAL_ZERO, cluster, 1, 0 };
+
+	pthread_mutex_lock(&journal_lock);
+	pending_append(&e, NULL, 0);
+	last_fat = -1;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* Append pending batch as one transaction, -ENOSPC if journal is full */
+int dfat_journal_commit()
+{
+	if(!enabled)
+		return 0;
+
+	pthread_mutex_lock(&journal_lock);
+
+	if(pending_size == 0)
+	{
+		pthread_mutex_unlock(&journal_lock);
+		return 0;
+	}
+
+	size_t size = tx_length(pending_size);
+	if(tail + size > journal_end)
+	{
+		pthread_mutex_unlock(&journal_lock);
+		return -ENOSPC;
+	}
+
+	/* Whole aligned sectors, so O_DIRECT needs no read-modify-write */
+	byte_t *buf;
+	if(posix_memalign((void**) &buf, DFAT_BUFFER_ALIGN, size))
+	{
+		pthread_mutex_unlock(&journal_lock);
+		return -ENOMEM;
+	}
+	memset(buf + sizeof(struct journal_tx) + pending_size, 0, size - sizeof(struct journal_tx) - pending_size);
+
+	struct journal_tx *tx = (struct journal_tx*) buf;
+	tx->magic = JOURNAL_MAGIC;
+	tx->seq = seq;
+	tx->size = pending_size;
+	tx->checksum = journal_checksum(seq, pending, pending_size);
+	memcpy(buf + sizeof(*tx), pending, pending_size);
+
+	int res = 0;
+	if( backend->write_at(buf, size, tail) < (ssize_t) size || backend->sync() < 0 )
+	{
+		error("dfat_journal_commit() %s\n", strerror(errno));
+		res = -EIO;
+	}
+	else
+	{
+		dfat_trace(DFAT_TR_JOURNAL, seq, size);
+		tail += size;
+		seq++;
+		committed += pending_size;
+		pending_size = 0;
+		last_fat = -1;
+	}
+
+	pthread_mutex_unlock(&journal_lock);
+	free(buf);
+
+	return res;
+}
+
+/* Mark of last durable change */
+unsigned long long dfat_journal_committed()
+{
+	pthread_mutex_lock(&journal_lock);
+	unsigned long long mark = committed;
+	pthread_mutex_unlock(&journal_lock);
+
+	return mark;
+}
+
+/* Make FAT changes durable now, called under fat lock when freed clusters
+ * are needed. Without journal FAT is written in place */
+int dfat_journal_force()
+{
+	if(enabled)
+		return dfat_journal_commit();
+
+	if(dfat_fat_write() < 0 || backend->sync() < 0)
+		return -EIO;
+
+	/* Marks grow under fat lock only */
+	pthread_mutex_lock(&journal_lock);
+	committed = appended;
+	pthread_mutex_unlock(&journal_lock);
+
+	return 0;
+}
+
+/* Return 1 if checkpoint is due: half of journal is used by committed
+ * and pending transactions */
+int dfat_journal_full()
+{
+	if(!enabled)
+		return 0;
+
+	pthread_mutex_lock(&journal_lock);
+	int full = (tail - journal_start) + pending_size > (journal_end - journal_start)/2;
+	pthread_mutex_unlock(&journal_lock);
+
+	return full;
+}
+
+/* Write cached clusters and FAT in place, then empty journal */
+int dfat_journal_checkpoint()
+{
+	int res = 0;
+
+	dfat_fat_lock();
+
+	/* Entries appended before this point reach their place below: FAT ones
+	 * are under fat lock, dir records are journaled after cache write */
+	pthread_mutex_lock(&journal_lock);
+	unsigned long long mark = appended;
+	pthread_mutex_unlock(&journal_lock);
+
+	if(dfat_cache_checkpoint() < 0)
+		res = -EIO;
+
+	if(dfat_fat_write() < 0 || backend->sync() < 0)
+		res = -EIO;
+
+	if(res == 0)
+	{
+		pthread_mutex_lock(&journal_lock);
+
+		if(committed < mark)
+		{
+			if(enabled)
+			{
+				size_t drop = mark - committed;
+				memmove(pending, pending + drop, pending_size - drop);
+				pending_size -= drop;
+				last_fat = -1;
+			}
+			committed = mark;
+		}
+
+		if(enabled && journal_write_header() < 0)
+			res = -EIO;
+
+		pthread_mutex_unlock(&journal_lock);
+	}
+
+	dfat_fat_unlock();
+
+	return res;
+}
+
+/* Apply committed transactions, called at mount before free clusters bitmap
+ * is built and before block cache exists */
+int dfat_journal_replay()
+{
+	struct journal_header h;
+
+	enabled = 0;
+	if(sinfo.journal_size < sinfo.sector_size*2)
+		return 0;
+
+	journal_start = journal_addr() + sinfo.sector_size;
+	journal_end = journal_addr() + sinfo.journal_size;
+	pending_size = 0;
+	appended = committed = 0;
+	last_fat = -1;
+
+	if( backend->read_at(&h, sizeof(h), journal_addr()) < (ssize_t) sizeof(h) )
+		return -1;
+
+	enabled = 1;
+
+	/* Freshly formatted journal */
+	if(h.magic != JOURNAL_MAGIC)
+	{
+		seq = 1;
+		return journal_write_header();
+	}
+
+	size_t size = journal_end - journal_start;
+	byte_t *log = malloc(size);
+	if(log == NULL || backend->read_at(log, size, journal_start) < (ssize_t) size)
+	{
+		free(log);
+		return -1;
+	}
+
+	/* Find committed transactions */
+	size_t end = 0;
+	unsigned int count = 0;
+	seq = h.seq;
+
+	while(end + sizeof(struct journal_tx) <= size)
+	{
+		struct journal_tx *tx = (struct journal_tx*)(log + end);
+
+		if(tx->magic != JOURNAL_MAGIC || tx->seq != seq
+		   || tx->size > size - end - sizeof(*tx)
+		   || tx->checksum != journal_checksum(seq, log + end + sizeof(*tx), tx->size))
+			break;
+
+		end += tx_length(tx->size);
+		seq++;
+		count++;
+	}
+
+	/* Record in cluster freed later must not overwrite its next owner */
+	unsigned int *freed = calloc(fat_count + 2, sizeof(unsigned int));
+	if(freed == NULL)
+	{
+		free(log);
+		return -1;
+	}
+
+	for(int pass = 0; pass < 2; pass++)
+	{
+		unsigned int n = 0;
+
+		for(size_t pos = 0; pos < end; )
+		{
+			struct journal_tx *tx = (struct journal_tx*)(log + pos);
+			size_t tx_end = pos + sizeof(*tx) + tx->size;
+			size_t next = pos + tx_length(tx->size);
+
+			for(pos += sizeof(*tx); pos + sizeof(struct journal_entry) <= tx_end; n++)
+			{
+				struct journal_entry *e = (struct journal_entry*)(log + pos);
+				pos += sizeof(*e) + ((e->type == JOURNAL_RECORD) ? sizeof(dir_record_t) : 0);
+
+				if(e->cluster < 2 || e->cluster + e->count > fat_count + 2)
+					continue;
+
+				if(pass == 0)
+				{
+					if(e->type == JOURNAL_FAT_FREE)
+						for(cluster_t i = 0; i < e->count; i++)
+							freed[e->cluster + i] = n + 1;
+					continue;
+				}
+
+				switch(e->type)
+				{
+				case JOURNAL_FAT_LINK:
+					for(cluster_t i = 0; i < e->count; i++)
+					{
+						FAT[e->cluster + i].index = (i + 1 < e->count) ? e->cluster + i + 1 : e->value;
+						dfat_fat_dirty(e->cluster + i);
+					}
+					break;
+				case JOURNAL_FAT_FREE:
+					for(cluster_t i = 0; i < e->count; i++)
+					{
+						FAT[e->cluster + i].index = 0;
+						dfat_fat_dirty(e->cluster + i);
+					}
+					break;
+				case JOURNAL_RECORD:
+					if(freed[e->cluster] <= n && e->value + sizeof(dir_record_t) <= sinfo.cluster_size)
+						backend->write_at(e + 1, sizeof(dir_record_t), dfat_cluster_offset(e->cluster) + e->value);
+					break;
+				case JOURNAL_ZERO:
+					if(freed[e->cluster] <= n)
+					{
+						byte_t zero[sinfo.cluster_size];
+						memset(zero, 0, sizeof(zero));
+						backend->write_at(zero, sizeof(zero), dfat_cluster_offset(e->cluster));
+					}
+					break;
+				}
+			}
+
+			pos = next;
+		}
+	}
+
+	free(freed);
+	free(log);
+
+	debug("FS\tjournal: %u transactions replayed\n", count);
+
+	if(count == 0)
+		return 0;
+
+	/* Make replayed state the new base */
+	if( dfat_fat_write() < 0 || backend->sync() < 0 )
+		return -1;
+
+	return journal_write_header();
+}
+
+void dfat_journal_close()
+{
+	free(pending);
+	pending = NULL;
+	pending_size = pending_capacity = 0;
+	enabled = 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "libdfat.h"
 #include "list.h"
 
@@ -5,41 +6,46 @@
 #include <errno.h>
 
 #include <libgen.h>
+#include <sched.h>
 
 
-void debug(const char *format, ...){
-  #if DEBUG
-	printf("\033[1;32m");
+/* Called by debug() and error() only when level is compiled in */
+void dfat_log(int level, const char *format, ...){
+    FILE *out = (level == DFAT_LOG_ERROR) ? stderr : stdout;
     va_list ap;
-    va_start(ap, format);
-    vfprintf( stdout, format, ap);
-    fflush(stdout);
-  #endif
-}
 
-void error(const char *format, ...){
-  #if DEBUG
-    fprintf(stderr, "\033[1;31m");
-    va_list ap;
+    fprintf(out, (level == DFAT_LOG_ERROR) ? "\033[1;31m" : "\033[1;32m");
     va_start(ap, format);
-    vfprintf( stderr, format, ap);
-    fflush(stderr);
-    printf("\033[1;32m");
-  #endif
+    vfprintf(out, format, ap);
+    va_end(ap);
+    fprintf(out, "\033[0m");
+    fflush(out);
 }
 
 /* Init operations */
 /******************************************************************************************/
+/* FAT is written by sector sized pages, bit is set when page was changed */
+static unsigned long long *fat_dirty;
+static size_t fat_pages;
+/* FAT+2 is aligned to DFAT_BUFFER_ALIGN, buffer is padded to whole page */
+static byte_t *fat_buffer;
+
 int dfat_load(const char *device)
 {
-	printf("\033[1;32m");
+	dfat_locks_init();
+	dfat_stats_reset();
 
-	fd = open(device, O_RDWR);
-	if( !fd )
+	if(backend == NULL)
+		dfat_set_backend("pread");
+
+	if( backend->open(device) < 0 )
+	{
 		error("dfat_load() can't open device %s\n", device);
-	debug("dfat_load() device '%s' opened (fd=%p)\n", device, fd);
+		return -1;
+	}
+	debug("dfat_load() device '%s' opened (backend %s)\n", device, backend->name);
 
-	read(fd, &sinfo, sizeof(sinfo));
+	backend->read_at(&sinfo, sizeof(sinfo), 0);
 
 	debug("FS\tSector size: %hu, cluster size: %hu, fat size: %u\n", 
 	       sinfo.sector_size, sinfo.cluster_size, sinfo.fat_size);
@@ -49,26 +55,130 @@ int dfat_load(const char *device)
 	debug("FS\t2 cluster offset: 0x%X\n", dfat_cluster_offset(2));
 
 	dfat_fat_load();
+	dcache_clear();
+	dindex_clear();
+
+	if( dfat_file_init() < 0 || dfat_cache_init() < 0 || dfat_sync_start() < 0 )
+		return -1;
 
 	debug("FS\tfree clusters: %u\n", dfat_free_space());
+
+	return 0;
 }
 
 void dfat_close()
 {
-	lseek(fd, sinfo.sector_size, SEEK_SET);
-	write(fd, FAT+2, sinfo.fat_size);
-	free(FAT);
-	close(fd);
+	dfat_sync_stop();
+	dfat_sync();
+	dfat_journal_checkpoint();
+	dfat_cache_close();
+	dfat_journal_close();
+	dcache_clear();
+	dindex_clear();
+	dfat_file_close();
+	bitmap_close();
+	free(fat_dirty);
+	free(fat_buffer);
+	backend->close();
+}
+
+/* Write empty file system to device or image file */
+/* Superblock, FAT, journal and root folder cluster are cleared, other
+ * clusters keep old bytes: folders are cleared and file tails are zeroed
+ * when clusters are allocated. FAT takes whole sectors, so clusters stay
+ * aligned for O_DIRECT. Return 0 or -errno. */
+int dfat_format(const char *device, unsigned short sector_size, unsigned short cluster_size,
+                const char *label, cluster_t journal_size)
+{
+	struct superblock_info info;
+	memset(&info, 0, sizeof(info));
+
+	if(sector_size < sizeof(info) || (sector_size & (sector_size - 1))
+	   || cluster_size < sizeof(dir_record_t) || cluster_size % sector_size
+	   || strlen(label) >= sizeof(info.label))
+		return -EINVAL;
+
+	info.magic = 0xDEDE;
+	info.sector_size = sector_size;
+	info.cluster_size = cluster_size;
+	strcpy(info.label, label);
+
+	/* Journal takes whole sectors: header and at least one for transactions */
+	info.journal_size = journal_size - journal_size % sector_size;
+	if(info.journal_size && info.journal_size < 2*sector_size)
+		info.journal_size = 2*sector_size;
+
+	int dev = open(device, O_WRONLY | O_CREAT, 0644);
+	if(dev < 0)
+		return -errno;
+
+	/* Block devices report their size by seek only */
+	off_t size = lseek(dev, 0, SEEK_END);
+	off_t meta = sector_size + info.journal_size;
+	long n = (size > meta) ? (size - meta)/(cluster_size + sizeof(struct fat_record)) : 0;
+	n -= n % (sector_size/sizeof(struct fat_record));
+
+	if(n < 1)
+	{
+		close(dev);
+		return -ENOSPC;
+	}
+
+	info.fat_size = n*sizeof(struct fat_record);
+	debug("dfat_format() %ld clusters, FAT %u B, journal %u B\n", n, info.fat_size, info.journal_size);
+
+	/* Everything before cluster 3 */
+	size_t chunk = 1 << 20;
+	off_t end = meta + info.fat_size + cluster_size;
+	byte_t *buf = calloc(1, chunk);
+	if(buf == NULL)
+	{
+		close(dev);
+		return -ENOMEM;
+	}
+
+	int res = 0;
+	for(off_t pos = 0; pos < end && res == 0; pos += chunk)
+	{
+		size_t len = (end - pos < chunk) ? end - pos : chunk;
+
+		if(pos == 0)
+		{
+			/* Root folder is cluster 2, the only one in chain */
+			struct fat_record root = { 1 };
+			memcpy(buf, &info, sizeof(info));
+			memcpy(buf + sector_size, &root, sizeof(root));
+		}
+
+		if(pwrite(dev, buf, len, pos) < (ssize_t) len)
+			res = -EIO;
+
+		if(pos == 0)
+			memset(buf, 0, sector_size + sizeof(struct fat_record));
+	}
+
+	if(res == 0 && fsync(dev) < 0)
+		res = -errno;
+
+	free(buf);
+	if(close(dev) < 0 && res == 0)
+		res = -errno;
+
+	return res;
 }
 
 /*Init FAT*/
 int dfat_fat_load()
 {
-	FAT = (struct fat_record*) malloc(sizeof(struct fat_record)*(sinfo.fat_size+2));
+	size_t fat_buffer_size = DFAT_BUFFER_ALIGN
+		+ (sinfo.fat_size + sinfo.sector_size - 1)/sinfo.sector_size*sinfo.sector_size;
+
+	if(posix_memalign((void**) &fat_buffer, DFAT_BUFFER_ALIGN, fat_buffer_size))
+		return -1;
 
+	FAT = (struct fat_record*)(fat_buffer + DFAT_BUFFER_ALIGN) - 2;
 
-	lseek(fd, sinfo.sector_size, SEEK_SET);
-	int readed = read(fd, FAT+2, sinfo.fat_size);
+	int readed = backend->read_at(FAT+2, sinfo.fat_size, sinfo.sector_size);
 
 	if(readed < sinfo.fat_size)
 	{
@@ -78,11 +188,75 @@ int dfat_fat_load()
 
 	fat_count = sinfo.fat_size/sizeof(struct fat_record);
 
-	dfat_print_fat();
+	fat_pages = (sinfo.fat_size + sinfo.sector_size - 1)/sinfo.sector_size;
+	fat_dirty = (unsigned long long*) calloc((fat_pages + 63)/64, sizeof(unsigned long long));
+	if(fat_dirty == NULL)
+		return -1;
+
+	if( dfat_journal_replay() < 0 )
+	{
+		error("dfat_fat_load() can't replay journal\n");
+		return -1;
+	}
+
+	if( bitmap_load() < 0 )
+		return -1;
 
 	return readed;
 }
 
+/*Mark FAT page of cluster for next dfat_fat_write() */
+void dfat_fat_dirty(cluster_t cluster)
+{
+	size_t page = (size_t)(cluster - 2)*sizeof(struct fat_record)/sinfo.sector_size;
+
+	fat_dirty[page/64] |= 1ULL << (page % 64);
+}
+
+/*Write changed FAT pages to device, called under fat lock */
+/* Consecutive dirty pages are written by one call */
+int dfat_fat_write()
+{
+	size_t page = 0;
+
+	while(page < fat_pages)
+	{
+		if(fat_dirty[page/64] == 0)
+		{
+			page = (page/64 + 1)*64;
+			continue;
+		}
+
+		if( !(fat_dirty[page/64] & (1ULL << (page % 64))) )
+		{
+			page++;
+			continue;
+		}
+
+		size_t run = 0;
+		while(page + run < fat_pages && (fat_dirty[(page + run)/64] & (1ULL << ((page + run) % 64))))
+			run++;
+
+		size_t offset = page*sinfo.sector_size;
+		size_t size = run*sinfo.sector_size;
+		if(size > sinfo.fat_size - offset)
+			size = sinfo.fat_size - offset;
+
+		if( backend->write_at((byte_t*)(FAT+2) + offset, size, sinfo.sector_size + offset) < (ssize_t) size )
+		{
+			error("dfat_fat_write() %s at FAT page %u\n", strerror(errno), page);
+			return -1;
+		}
+
+		for(size_t i = page; i < page + run; i++)
+			fat_dirty[i/64] &= ~(1ULL << (i % 64));
+
+		page += run;
+	}
+
+	return 0;
+}
+
 /* Comon operations */
 /******************************************************************************************/
 /*Geting directory record from cluster cluster_num with record_num */
@@ -103,15 +277,9 @@ dir_record_t dfat_read_dir_record(cluster_t cluster_num, unsigned char record_nu
 		return dir_record;
 	}
 
-	laddr_t clusterAddress = dfat_cluster_offset(cluster_num);
-	laddr_t recordAddress = clusterAddress + sizeof(dir_record_t)*record_num;
-
-	lseek(fd, recordAddress, SEEK_SET);
-	int readed = read(fd, &dir_record, sizeof(dir_record));
-
-	if(readed < sizeof(dir_record))
+	if( dfat_cache_read(cluster_num, sizeof(dir_record_t)*record_num, &dir_record, sizeof(dir_record)) < 0 )
 	{
-		perror("dfat_read_dir_record()");
+		dir_record.name[0]=0x0;
 		error("dfat_read_dir_record(): can't read dir record at cluster %u and number %u\n",
 		        cluster_num, (cluster_t) record_num);
 	}
@@ -119,21 +287,74 @@ dir_record_t dfat_read_dir_record(cluster_t cluster_num, unsigned char record_nu
 	return dir_record;
 }
 
+/* Read directory record at linear address */
+int dfat_read_record(laddr_t addr, dir_record_t *r)
+{
+	cluster_t cluster = dfat_addr_cluster(addr);
+
+	if( dfat_cache_read(cluster, addr - dfat_cluster_offset(cluster), r, sizeof(dir_record_t)) < 0 )
+	{
+		error("dfat_read_record() can't read record at address %X\n", addr);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Read all directory records of cluster cluster_num by one call */
+/* records must have place for cluster_size/sizeof(dir_record_t) items */
+int dfat_read_dir_cluster(cluster_t cluster_num, dir_record_t *records)
+{
+	if(cluster_num < 2)
+	{
+		error("dfat_read_dir_cluster() incorrect cluster number: %u\n\n", cluster_num);
+		return -1;
+	}
+
+	if( dfat_cache_read(cluster_num, 0, records, sinfo.cluster_size) < 0 )
+	{
+		error("dfat_read_dir_cluster(): can't read cluster %u\n", cluster_num);
+		return -1;
+	}
+
+	return 0;
+}
+
 /*Writing directory record from cluster cluster_num with record_num */
 int dfat_write_dir_record(laddr_t addr, dir_record_t r)
 {
-	lseek(fd, addr, SEEK_SET);
-	int writed = write(fd, &r, sizeof(r));
-	fdatasync(fd);
+	cluster_t cluster = dfat_addr_cluster(addr);
 
-	if(writed < sizeof(r))
+	/* Record reaches device at next cache flush */
+	if( dfat_cache_write(cluster, addr - dfat_cluster_offset(cluster), &r, sizeof(r)) < 0 )
 	{
-		error("dfat_write_dir_record() %d %s record at address %X, fd = %p\n",
-		  writed, strerror(errno), addr, fd);
+		error("dfat_write_dir_record() can't write record at address %X\n", addr);
 
 		return -1;
 	}
 
+	/* Journaled after cache write, see dfat_journal_checkpoint() */
+	dfat_journal_record(addr, &r);
+
+	dcache_update(addr, &r);
+
+	return 0;
+}
+
+/* Fill cluster by zeroes */
+int dfat_clear_cluster(cluster_t cluster_num)
+{
+	byte_t zero[sinfo.cluster_size];
+	memset(zero, 0, sizeof(zero));
+
+	if( dfat_cache_write(cluster_num, 0, zero, sizeof(zero)) < 0 )
+	{
+		error("dfat_clear_cluster() can't clear cluster %u\n", cluster_num);
+		return -1;
+	}
+
+	dfat_journal_zero(cluster_num);
+
 	return 0;
 }
 
@@ -147,7 +368,13 @@ laddr_t dfat_cluster_offset(cluster_t cluster_num)
 	if(cluster_num == 0x1)
 		return 1;
 	/*Return linear address for cluster */
-	return sinfo.sector_size + sinfo.fat_size + sinfo.cluster_size*(cluster_num-2);
+	return sinfo.sector_size + sinfo.fat_size + sinfo.journal_size + sinfo.cluster_size*(cluster_num-2);
+}
+
+/*Cluster of linear address */
+cluster_t dfat_addr_cluster(laddr_t addr)
+{
+	return (addr - sinfo.sector_size - sinfo.fat_size - sinfo.journal_size)/sinfo.cluster_size + 2;
 }
 
 /*Print FAT to STDOUT */
@@ -158,42 +385,216 @@ void dfat_print_fat()
 	for(cluster_t i=2; i<fat_count+2;)
 	{
 		for( int j = 0; j<10 && i<fat_count+2; j++, i++)
-			printf("%4u:%8u| ", i, FAT[i]);
+			printf("%4u:%8u| ", i, FAT[i].index);
 
 		printf("\n");
 	}
 }
 
-/* Read files/folders dir in folder */
+/* Folder iterator */
+/* Offset is cluster*ecount + slot + 1 of record to read next, so reading
+ * resumes at any record without walking the chain. 0 starts from the first
+ * record, cluster 1 (EOF) is past the last one. */
+static int folder_readdir(cluster_t cluster_num, off_t offset, dfat_filldir_t fill, void *ctx)
+{
+	cluster_t ecount = sinfo.cluster_size / sizeof(dir_record_t);
+	dir_record_t records[ecount];
+	cluster_t cluster_i = cluster_num;
+	cluster_t record_i = 0;
+
+	dfat_dir_lock(cluster_num);
+
+	if(offset > 0)
+	{
+		cluster_i = (offset - 1) / ecount;
+		record_i = (offset - 1) % ecount;
+
+		/* Cluster was dropped from folder since last call, it may be free or
+		 * belong to other file now. Chain of folder is stable under its lock */
+		cluster_t c = cluster_num;
+		for(cluster_t n = 0; c > 1 && c != cluster_i && n < fat_count; n++)
+			c = FAT[c].index;
+
+		/* 1 is end of folder, reached by offset after its last record */
+		if(cluster_i == 0 || (cluster_i > 1 && c != cluster_i))
+		{
+			dfat_dir_unlock(cluster_num);
+			return -EINVAL;
+		}
+	}
+
+	while(cluster_i > 1) {
+		if( dfat_read_dir_cluster(cluster_i, records) < 0 )
+		{
+			dfat_dir_unlock(cluster_num);
+			return -EIO;
+		}
+
+		for(; record_i < ecount; record_i++) {
+			/* Skip free dir record */
+			if(records[record_i].name[0] == 0x0)
+				continue;
+
+			off_t next = (record_i + 1 < ecount) ? (off_t) cluster_i*ecount + record_i + 2
+			                                     : (off_t) FAT[cluster_i].index*ecount + 1;
+			if( fill(ctx, &records[record_i], next) )
+			{
+				dfat_dir_unlock(cluster_num);
+				return 0;
+			}
+		}
+
+		cluster_i = FAT[cluster_i].index;
+		record_i = 0;
+	}
+
+	dfat_dir_unlock(cluster_num);
+
+	return 0;
+}
+
+int dfat_readdir(cluster_t cluster_num, off_t offset, dfat_filldir_t fill, void *ctx)
+{
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_READDIR);
+	int res = folder_readdir(cluster_num, offset, fill, ctx);
+	dfat_stats_end(&t, res);
+
+	return res;
+}
+
+/* Return 1 if folder has no records, stops at first one. -EIO if a cluster
+ * can't be read: folder is not known to be empty, so it must not be freed */
+int dfat_dir_empty(cluster_t cluster_num)
+{
+	cluster_t ecount = sinfo.cluster_size / sizeof(dir_record_t);
+	dir_record_t records[ecount];
+
+	dfat_dir_lock(cluster_num);
+
+	for(cluster_t cluster_i = cluster_num; cluster_i > 1; cluster_i = FAT[cluster_i].index) {
+		if( dfat_read_dir_cluster(cluster_i, records) < 0 ) {
+			dfat_dir_unlock(cluster_num);
+			return -EIO;
+		}
+
+		for(cluster_t record_i = 0; record_i < ecount; record_i++) {
+			if(records[record_i].name[0] != 0x0) {
+				dfat_dir_unlock(cluster_num);
+				return 0;
+			}
+		}
+	}
+
+	dfat_dir_unlock(cluster_num);
+
+	return 1;
+}
+
+static int list_fill(void *ctx, const dir_record_t *r, off_t next)
+{
+	struct list *l = ctx;
+
+	if(l->count == LIST_SIZE)
+		return 1;
+
+	list_append(*r, l);
+	return 0;
+}
+
+/* Read files/folders dir in folder, up to LIST_SIZE records */
 struct list *dfat_read_folder(cluster_t cluster_num, struct list* l)
 {
-	//debug("dfat_read_folder():\n");
-	int record_i = 0;
+	dfat_readdir(cluster_num, 0, list_fill, l);
+
+	return l;
+}
+
+/* Looking for record with name in folder cluster chain and return absolute address */
+static laddr_t folder_lookup(cluster_t cluster_num, const char *name, dir_record_t *out_record)
+{
+	laddr_t addr;
+	dir_record_t r;
+
+	if( dcache_lookup(cluster_num, name, &r, &addr) )
+	{
+		if(addr == 0)
+		{
+			errno = ENOENT;
+			return 0;
+		}
+
+		if(out_record != NULL)
+			memcpy(out_record, &r, sizeof(r));
+		return addr;
+	}
+
 	cluster_t cluster_i = cluster_num;
 	cluster_t ecount = sinfo.cluster_size / sizeof(dir_record_t);
+	dir_record_t records[ecount];
 
-	while(1) {
-		dir_record_t r = dfat_read_dir_record(cluster_i, record_i);
-		/* Readed free dir record */
-		
-		if(r.name[0] != 0x0) {
-			list_append(r, l);
-			//debug("\t%s\n", r.name);
+	dfat_dir_lock(cluster_num);
+	/* Record size may be rewritten by file writer while we read the folder */
+	unsigned long stamp = dcache_stamp();
+
+	if( dindex_lookup(cluster_num, name, &r, &addr) )
+	{
+		dcache_insert_stamped(stamp, cluster_num, name, addr, addr ? &r : NULL);
+		dfat_dir_unlock(cluster_num);
+
+		if(addr == 0)
+		{
+			errno = ENOENT;
+			return 0;
 		}
-		record_i++;
 
-		if(record_i == ecount) {
-			record_i = 0;
-			cluster_i = FAT[cluster_i].index;
+		if(out_record != NULL)
+			memcpy(out_record, &r, sizeof(r));
+		return addr;
+	}
+
+	/* Folder can't be indexed, scan it */
 
-			//debug("\tnext cluster %u\n", cluster_i);
+	while(cluster_i > 1) {
+		if( dfat_read_dir_cluster(cluster_i, records) < 0 )
+			break;
 
-			if( cluster_i == 1 ) 
-				break;
+		for(cluster_t record_i = 0; record_i < ecount; record_i++)
+		{
+			if( strcmp(records[record_i].name, name)==0 )
+			{
+				addr = dfat_cluster_offset(cluster_i) + record_i*sizeof(dir_record_t);
+				dcache_insert_stamped(stamp, cluster_num, name, addr, &records[record_i]);
+				dfat_dir_unlock(cluster_num);
+
+				if(out_record != NULL)
+					memcpy(out_record, &records[record_i], sizeof(dir_record_t));
+				//debug("\trecord finded at: %u:%u\n", cluster_i, record_i);
+				return addr;
+			}
 		}
+
+		cluster_i = FAT[cluster_i].index;
 	}
 
-	return l;
+	/* Record not founded*/
+	dcache_insert_stamped(stamp, cluster_num, name, 0, NULL);
+	dfat_dir_unlock(cluster_num);
+	errno = ENOENT;
+	return 0;
+}
+
+laddr_t dfat_lookup(cluster_t cluster_num, const char *name, dir_record_t *out_record)
+{
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_LOOKUP);
+	laddr_t addr = folder_lookup(cluster_num, name, out_record);
+	dfat_stats_end(&t, 0);
+
+	dfat_trace(DFAT_TR_LOOKUP, cluster_num, addr);
+	return addr;
 }
 
 laddr_t dfat_find_dir_record(const char* path, dir_record_t *out_record)
@@ -201,8 +602,6 @@ laddr_t dfat_find_dir_record(const char* path, dir_record_t *out_record)
 	//debug("dfat_find_dir_record() for %s\n", path);
 	/* Cluster point to first cluster where located root dir record */
 	cluster_t cluster_i = 2; 
-	byte_t record_i = 0;
-	byte_t ecount = sinfo.cluster_size / sizeof(dir_record_t);
 
 	/*Parse path*/
 	char* s[MAX_FILE_COUNT];
@@ -228,48 +627,27 @@ laddr_t dfat_find_dir_record(const char* path, dir_record_t *out_record)
 
 	/*Looking for record dir*/
 	while(j!=-1) {
-		
-		while(1) {
-			r = dfat_read_dir_record(cluster_i, record_i);
-
-			if( strcmp(r.name, s[j])==0 )
-			{
-				if(j==0)
-				{
-					if(out_record != NULL)
-						memcpy(out_record, &r, sizeof(r));
-					laddr_t addr = dfat_cluster_offset(cluster_i) + record_i*sizeof(dir_record_t);
-					//debug("\trecord finded at: %u:%u\n", cluster_i, record_i);
-					return addr;
-				}
-
-				record_i = 0;
-				cluster_i = r.index;
-				//debug("\trecord .name=%s record .index=%u\n", r.name, r.index);
-				break;
-			}
-
-
-			record_i++;
+		laddr_t addr = dfat_lookup(cluster_i, s[j], &r);
 
-			if(record_i == ecount)
-			{
-				record_i = 0;
-				cluster_i = FAT[cluster_i].index;
-				/* Record not founded*/
-				if(cluster_i < 2)
-				{
-					error("\tdir record with name %s don't exist\n", s[j]);
-					errno = ENOENT;
-					return 0;
-				}
-
-				continue;
-			}
+		if(addr == 0)
+		{
+			debug("\tdir record with name %s don't exist\n", s[j]);
+			return 0;
+		}
 
+		if(j==0)
+		{
+			if(out_record != NULL)
+				memcpy(out_record, &r, sizeof(r));
+			return addr;
 		}
+
+		cluster_i = r.index;
+		//debug("\trecord .name=%s record .index=%u\n", r.name, r.index);
 		j--;
 	}
+
+	return 0;
 }
 
 int dfat_exist( const char *path )
@@ -298,148 +676,337 @@ int dfat_get_path(const char *path, char** separated)
 	return i;
 }
 
+/* Append cleared cluster to folder chain ended by last, return its first record address */
+static laddr_t dfat_extend_dir(cluster_t dir, cluster_t last)
+{
+	cluster_t new_cluster = dfat_allocate_cluster(last);
+	debug("dfat_find_free_dir_record() %u:%u\n", new_cluster, 0);
+	if(new_cluster < 2 || dfat_clear_cluster(new_cluster) < 0)
+		return 0;
+
+	dindex_grow(dir, new_cluster);
+	return dfat_cluster_offset(new_cluster);
+}
+
 /* Find free dir record in folder, if don't have - take it! */
 /* Lookong for free record in folder cluster and return absolute address*/
 laddr_t dfat_find_free_dir_record(cluster_t cluster_num)
 {
-	int eof = 0;
-	/*Record index in cluster */
-	int record_i = 0;
+	laddr_t addr;
+	cluster_t last;
+
+	/* Indexed folder knows its free slots */
+	if( dindex_free_slot(cluster_num, &addr, &last) )
+		return addr ? addr : dfat_extend_dir(cluster_num, last);
+
 	/* Current cluster for looking */
 	cluster_t cluster_i = cluster_num;
 	/* Count of dir records in cluster */
 	cluster_t ecount = sinfo.cluster_size/sizeof(dir_record_t);
+	dir_record_t records[ecount];
 
 	while(1)
 	{
-		dir_record_t r = dfat_read_dir_record(cluster_i, record_i);
-		/* Readed free dir record */
-		if(r.name[0] == 0x0) {
-			/* Calculating record dir absolute address */
-			debug("dfat_find_free_dir_record() %u:%u\n", cluster_i, record_i);
-			return ( dfat_cluster_offset(cluster_i) 
-					+ record_i*sizeof(dir_record_t));
-		}
+		if( dfat_read_dir_cluster(cluster_i, records) < 0 )
+			return 0;
 
-		record_i++;
-
-		/* Reached the end of cluster, looking for next cluster in FAT */
-		if(record_i==ecount)
+		for(cluster_t record_i = 0; record_i < ecount; record_i++)
 		{
-			record_i = 0;
-
-			if( FAT[cluster_i].index == 1 )
-			{
-
-				cluster_t new_cluster = dfat_allocate_cluster(cluster_i);
-				debug("dfat_find_free_dir_record() %u:%u\n", new_cluster, 0);
-				return dfat_cluster_offset(new_cluster);
+			/* Readed free dir record */
+			if(records[record_i].name[0] == 0x0) {
+				/* Calculating record dir absolute address */
+				debug("dfat_find_free_dir_record() %u:%u\n", cluster_i, record_i);
+				return ( dfat_cluster_offset(cluster_i) 
+						+ record_i*sizeof(dir_record_t));
 			}
-			else
-				cluster_i = FAT[cluster_i].index;
 		}
+
+		/* Reached the end of cluster, looking for next cluster in FAT */
+		if( FAT[cluster_i].index == 1 )
+			return dfat_extend_dir(cluster_num, cluster_i);
+		else
+			cluster_i = FAT[cluster_i].index;
 	}
 }
+/* Update FAT record of cluster, keep free clusters bitmap in sync */
+/* Freed cluster is not allocated again till its free is committed */
+void dfat_fat_set(cluster_t cluster, cluster_t next)
+{
+	cluster_t old = FAT[cluster].index;
+
+	FAT[cluster].index = next;
+	dfat_fat_dirty(cluster);
+	bitmap_update(cluster, old, next, dfat_journal_fat(cluster, next));
+}
+
 /*Allocate new cluster*/
 cluster_t dfat_allocate_cluster(cluster_t prev_cluster)
 {
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_ALLOC);
+	dfat_fat_lock();
+
+	bitmap_reclaim(0);
 	cluster_t new_cluster = dfat_take_new_cluster(prev_cluster);
+	if(new_cluster < 2 && bitmap_reclaim(1))
+		new_cluster = dfat_take_new_cluster(prev_cluster);
 	
 	if(new_cluster<2)
+	{
+		dfat_fat_unlock();
+		dfat_stats_end(&t, -ENOSPC);
 		return 0;
+	}
 
 	if(prev_cluster>1)
 	{
-		FAT[prev_cluster].index = new_cluster;
+		dfat_fat_set(prev_cluster, new_cluster);
 	}
 	/*Mark cluster as last*/
-	FAT[new_cluster].index = 0x1;
+	dfat_fat_set(new_cluster, 0x1);
+
+	dfat_fat_unlock();
+	dfat_stats_end(&t, 0);
 	return new_cluster;
 }
 
-/* Take a new cluster */
-/* Return cluster number 
- * if not free space:	0
- * if not last cluster:	1
- */
-cluster_t dfat_take_new_cluster(cluster_t prev_cluster/*Previous last cluster*/)
+/* Allocate up to count contiguous clusters after prev_cluster */
+/* Chain is extended in place when clusters right after prev_cluster are free,
+ * otherwise best fit extent is taken */
+static cluster_t allocate_run(cluster_t prev_cluster, cluster_t count, cluster_t *allocated)
 {
-	/*Loking for free cluster */
-	for(cluster_t i = prev_cluster+1; i<fat_count+2; i++)
+	cluster_t first = 0;
+	cluster_t length = 0;
+
+	*allocated = 0;
+	if(count == 0)
+		return 0;
+
+	dfat_fat_lock();
+
+	bitmap_reclaim(0);
+
+	if(prev_cluster > 1)
+		length = bitmap_run(prev_cluster + 1, count);
+
+	if(length)
+		first = prev_cluster + 1;
+	else
+		first = bitmap_best_fit(count, &length);
+
+	if(first < 2 && bitmap_reclaim(1))
+		first = bitmap_best_fit(count, &length);
+
+	if(first < 2)
 	{
-		if(FAT[i].index==0) {
-			return i;
-		}
+		dfat_fat_unlock();
+		return 0;
 	}
 
-	for(cluster_t i=3; i<prev_cluster; i++)
+	if(length > count)
+		length = count;
+
+	/* Link run: prev -> first -> ... -> first+length-1 -> EOF */
+	for(cluster_t i = 0; i < length - 1; i++)
+		dfat_fat_set(first + i, first + i + 1);
+	dfat_fat_set(first + length - 1, 0x1);
+
+	if(prev_cluster > 1)
+		dfat_fat_set(prev_cluster, first);
+
+	dfat_fat_unlock();
+
+	dfat_trace(DFAT_TR_ALLOC, first, length);
+
+	*allocated = length;
+	return first;
+}
+
+cluster_t dfat_allocate_clusters(cluster_t prev_cluster, cluster_t count, cluster_t *allocated)
+{
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_ALLOC);
+	cluster_t first = allocate_run(prev_cluster, count, allocated);
+	dfat_stats_end(&t, (first || count == 0) ? 0 : -ENOSPC);
+
+	return first;
+}
+
+/* Return clusters of chain started at first to free space */
+cluster_t dfat_free_chain(cluster_t first)
+{
+	cluster_t c_next = first;
+	cluster_t c_prev;
+	cluster_t counter = 0;
+
+	dfat_fat_lock();
+
+	debug("\tfreeing clusters: ");
+	while(c_next > 2)
 	{
-		if(FAT[i].index==0) {
-			return i;
-		}
+		counter++;
+		debug("%u ", c_next);
+		c_prev = c_next;
+		c_next = FAT[c_prev].index;
+		dfat_fat_set(c_prev, 0x0);
+		/* Dirty copy of freed cluster must not overwrite its next owner */
+		dfat_cache_invalidate(c_prev, 1);
 	}
+	debug("\n\tcleared %u cluster => %u kB\n", counter, counter*sinfo.cluster_size/1024);
 
-	return 0;
+	dfat_fat_unlock();
+
+	dfat_trace(DFAT_TR_FREE, first, counter);
+	return counter;
 }
 
-cluster_t dfat_find_free_cluster(cluster_t cluster_num/*Prev cluster*/)
+/* Append count clusters to chain with last cluster last */
+int dfat_extend_chain(cluster_t last, cluster_t count)
 {
-	for(cluster_t i=2; i<fat_count+2; i++)
+	while(count)
 	{
-		if(FAT[i].index == 0)
-			return i;
+		cluster_t allocated;
+		cluster_t first = dfat_allocate_clusters(last, count, &allocated);
+
+		if(first < 2)
+			return -ENOSPC;
+
+		debug("\tallocated clusters: %u-%u\n", first, first + allocated - 1);
+		last = first + allocated - 1;
+		count -= allocated;
 	}
 
 	return 0;
 }
 
+/* Take a new cluster */
+/* Return cluster number 
+ * if not free space:	0
+ */
+cluster_t dfat_take_new_cluster(cluster_t prev_cluster/*Previous last cluster*/)
+{
+	/*Loking for free cluster after previous, wrap around at the end */
+	return bitmap_find_free(prev_cluster+1);
+}
+
+cluster_t dfat_find_free_cluster(cluster_t cluster_num/*Prev cluster*/)
+{
+	return bitmap_find_free(2);
+}
+
 size_t dfat_free_space()
 {
-	size_t space = 0;
-	for(cluster_t i=2; i<fat_count+2; i++)
+	return bitmap_free_count();
+}
+
+size_t dfat_total_space()
+{
+	return fat_count - bitmap_free_count(); //cluster counts
+}
+
+/* Write operations */
+/******************************************************************************************/
+/* Looking for parent folder record of path, copy last path element to name */
+laddr_t dfat_find_parent(const char *path, dir_record_t *parent, char *name)
+{
+	char *dir = strdup(path);
+	char *base = strdup(path);
+	char *bname = basename(base);
+	laddr_t addr = 0;
+
+	if(strlen(bname) >= SIZE_NAME)
+		errno = ENAMETOOLONG;
+	else
 	{
-		if(FAT[i].index == 0)
-			space++;
+		strcpy(name, bname);
+		addr = dfat_find_dir_record(dirname(dir), parent);
 	}
 
-	return space;
+	free(dir);
+	free(base);
+
+	return addr;
 }
 
-size_t dfat_total_space()
+/* Find file record and take its lock, for write - exclusive */
+/* Return record address, 0 if file don't exist */
+laddr_t dfat_lock_file(const char *path, dir_record_t *record, int write)
 {
-	size_t space = 0;
+	char name[SIZE_NAME];
 
-	for(cluster_t i=2; i<fat_count+2; i++)
+	while(1)
 	{
-		if(FAT[i].index != 0)
-			space++;
-	}
+		laddr_t addr = dfat_find_dir_record(path, record);
+
+		if(addr == 0)
+			return 0;
 
-	return space; //cluster counts
+		strcpy(name, record->name);
+		cluster_t index = record->index;
+		if(write)
+			dfat_file_wrlock(index);
+		else
+			dfat_file_rdlock(index);
+
+		/* File could be changed, deleted or renamed before lock was taken.
+		 * Folder locks go before file locks, so recheck record on device */
+		if(dfat_read_record(addr, record) == 0 && record->index == index
+		   && strcmp(record->name, name) == 0)
+			return addr;
+
+		dfat_file_unlock(index);
+	}
 }
 
-/* Write operations */
-/******************************************************************************************/
 int dfat_create(const char* path, byte_t flags, dir_record_t* out)
+{
+	dir_record_t parrent_folder;
+	char name[SIZE_NAME];
+
+	/* Checking for correct dir record */
+	if( !dfat_find_parent(path, &parrent_folder, name) ) {
+		error("dfat_create() can't find parrent folder dir record\n");
+		return -errno;
+	}
+
+	debug("dfat_create() finded parrent folder: %s\n", parrent_folder.name);
+
+	return dfat_create_at(parrent_folder.index, name, flags, out);
+}
+
+/* Create record with name in folder with first cluster parent */
+static int record_create(cluster_t parent, const char *name, byte_t flags, dir_record_t* out)
 {
 	dir_record_t r;
-	r.name[0] = 0x0;
+	memset(&r, 0, sizeof(r));
 	r.flags =flags;
-	r.size = 0x0;
-	r.index = 0x0;
 
-	if( dfat_exist(path) )
+	if(strlen(name) >= SIZE_NAME) {
+		errno = ENAMETOOLONG;
+		return -ENAMETOOLONG;
+	}
+	strcpy(r.name, name);
+
+	laddr_t addr;
+
+	dfat_dir_lock(parent);
+
+	if( dfat_lookup(parent, r.name, NULL) )
 	{
-		error("dfat_create() file/folder exist %s\n", path);
+		dfat_dir_unlock(parent);
+		debug("dfat_create() file/folder exist %s\n", name);
 		errno = EEXIST;
 		return -EEXIST;
 	}
 
-	/* Looking for free cluster */
-	cluster_t cluster = dfat_find_free_cluster(2);
+	/* Looking for free cluster, mark it by EOF */
+	cluster_t cluster = dfat_allocate_cluster(0);
 	/*Checking for correct cluster number */
 	if(cluster < 2)
 	{
+		dfat_dir_unlock(parent);
 		error("dfat_create() fs don't have free cluster");
 		errno = ENOSPC;
 		return -ENOSPC;
@@ -447,282 +1014,323 @@ int dfat_create(const char* path, byte_t flags, dir_record_t* out)
 	
 	debug("dfat_create() cluster assigned with file: %u\n", cluster);
 
-	char *dir = strdup(path);
-	char *filename = strdup(path);
-	dir = dirname(dir);
-	filename = basename(filename);
-
-	dir_record_t parrent_folder;
-	laddr_t addr = dfat_find_dir_record(dir, &parrent_folder);
-	/* Checking for correct dir record */
-	if(addr == 0) {
-		error("dfat_create() can't find parrent folder dir record\n");
-		errno = ENOENT;
-		return -ENOENT;
-	}
-
-	debug("dfat_create() finded parrent folder: %s\n", parrent_folder.name);
-
-	FAT[cluster].index = 0x1; /*Fill by EOF*/
+	/* Folder cluster must not contain records of previous owner */
+	if(flags & 0x80)
+		dfat_clear_cluster(cluster);
+	/* Cluster may be reused, file must not pass for the previous owner */
+	dfat_file_born(cluster);
 	r.index = cluster;
 
-	//fill r.name by null
-	memset(r.name, 0, sizeof(r.name));
-	/*Fill file name*/
-	strcpy(r.name, filename);
-
 	/*Get linear address of free dir record at cluster*/
-	addr =  dfat_find_free_dir_record(parrent_folder.index);
+	addr =  dfat_find_free_dir_record(parent);
 
 	if( addr == 0 )
 	{
+		dfat_free_chain(cluster);
+		dfat_dir_unlock(parent);
 		error("dfat_create() can't find free dir records at parrent folder\n");
-		errno = ENOENT;
-		return -ENOENT;
+		errno = ENOSPC;
+		return -ENOSPC;
 	}
-	/*Move write cursor*/
-	int seek = lseek(fd, addr, SEEK_SET);
 	/* Write record to device */
-	int writed = write(fd, &r, sizeof(r));
-	fdatasync(fd);
-
-	if( writed < sizeof(r) )
+	if( dfat_write_dir_record(addr, r) < 0 )
 		perror("dfat_create_file()");
 
-	#if DEBUG
-		debug("dfat_create(): file/folder %s created at addr 0x%X [%u]\n", 
-		        r.name, addr, sizeof(r) );
-	#endif
+	dcache_insert(parent, r.name, addr, &r);
+	dindex_insert(parent, r.name, addr);
+
+	dfat_dir_unlock(parent);
+
+	debug("dfat_create(): file/folder %s created at addr 0x%X [%u]\n",
+	        r.name, addr, sizeof(r) );
+
+	dfat_trace(DFAT_TR_CREATE, parent, r.index);
 
 	if(out != NULL)
 		memcpy(out, &r, sizeof(r));
 
-	return 0;
+	return dfat_commit();
+}
+
+int dfat_create_at(cluster_t parent, const char *name, byte_t flags, dir_record_t* out)
+{
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_CREATE);
+	int res = record_create(parent, name, flags, out);
+	dfat_stats_end(&t, res);
+
+	return res;
 }
 
 int dfat_unlink(const char* path)
 {
 	debug("dfat_unlink() path=%s\n", path);
-	dir_record_t r;
-	laddr_t addr = dfat_find_dir_record(path, &r);
+	dir_record_t parent;
+	char name[SIZE_NAME];
 
-	if( !addr )
+	if( !dfat_find_parent(path, &parent, name) )
 	{
-		error("dfat_unlink() don't exist %s\n", path);
-		errno = ENOENT;
-		return -1;
+		debug("dfat_unlink() don't exist %s\n", path);
+		return -errno;
 	}
 
-	r.name[0] = 0x0;
-	cluster_t c_next = r.index;
-	cluster_t c_prev;
-	cluster_t counter = 0;
-	debug("\tfreeing clusters: ");
-	while(c_next > 2)
-	{
-		counter++;
-		debug("%u ", c_next);
-		c_prev = c_next;
-		c_next = FAT[c_prev].index;
-		FAT[c_prev].index = 0x0;
-	}
-	debug("\n\tcleared %u cluster => %u kB\n", counter, counter*sinfo.cluster_size/1024);
-	dfat_write_dir_record(addr, r);
-
-	return 0;
+	return dfat_unlink_at(parent.index, name);
 }
 
-int dfat_rmdir(const char* path)
+static int record_unlink(cluster_t dir, const char *name)
 {
 	dir_record_t r;
-	laddr_t addr = dfat_find_dir_record(path, &r);
+
+	dfat_dir_lock(dir);
+
+	laddr_t addr = dfat_lookup(dir, name, &r);
 
 	if( !addr )
 	{
+		dfat_dir_unlock(dir);
+		debug("dfat_unlink() don't exist %s\n", name);
 		errno = ENOENT;
-		return -1;
+		return -ENOENT;
 	}
 
-	struct list l;
-	list_clear(&l);
-	dfat_read_folder(r.index, &l);
-	
-	if(l.count)
+	if(r.flags & 0x80)
 	{
-		errno = EEXIST;
-		return -ENOTEMPTY;
+		dfat_dir_unlock(dir);
+		errno = EISDIR;
+		return -EISDIR;
 	}
 
+	/* Wait for readers and writers of file */
+	dfat_file_wrlock(r.index);
+
+	if( !dfat_file_unlinked(addr) )
+		dfat_free_chain(r.index);
 	r.name[0] = 0x0;
+	dfat_write_dir_record(addr, r);
+	dindex_remove(dir, name, addr);
 
-	cluster_t c_next = r.index;
-	cluster_t c_prev;
+	dfat_file_unlock(r.index);
+	dfat_dir_unlock(dir);
 
-	cluster_t counter = 0x0;
-	debug("\tfreeing clusters: ");
-	while(c_next > 2)
-	{
-		counter++;
-		debug("%u ", c_next);
-		c_prev = c_next;
-		c_next = FAT[c_prev].index;
-		FAT[c_prev].index = 0x0;
-	}
-	debug("\n\tcleared %u cluster => %u kB\n", counter, counter*sinfo.cluster_size/1024);
-	dfat_write_dir_record(addr, r);
+	dfat_trace(DFAT_TR_UNLINK, dir, r.index);
+	return dfat_commit();
+}
 
-	return 0;
+int dfat_unlink_at(cluster_t dir, const char *name)
+{
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_UNLINK);
+	int res = record_unlink(dir, name);
+	dfat_stats_end(&t, res);
+
+	return res;
 }
 
-int dfat_rename(const char* path, const char* newpath)
+int dfat_rmdir(const char* path)
+{
+	dir_record_t parent;
+	char name[SIZE_NAME];
+
+	if( !dfat_find_parent(path, &parent, name) )
+		return -errno;
+
+	return dfat_rmdir_at(parent.index, name);
+}
+
+int dfat_rmdir_at(cluster_t dir, const char *name)
 {
 	dir_record_t r;
-	laddr_t addr = dfat_find_dir_record(path, &r);
-	
-	if(addr == 0 )
+
+	while(1)
 	{
-		error("dfat_rename() %s don't exist\n", path);
-		errno = ENOENT;
-		return -ENOENT;
-	}
+		if( !dfat_lookup(dir, name, &r) )
+		{
+			errno = ENOENT;
+			return -ENOENT;
+		}
 
-	char *bname = strdup(newpath);
-	bname = basename(bname);
-	debug("\tnew name %s\n", bname);
+		if( !(r.flags & 0x80) )
+		{
+			errno = ENOTDIR;
+			return -ENOTDIR;
+		}
 
-	char *odir = strdup(path);
-	char *ndir = strdup(newpath);
-	odir = dirname(odir);
-	ndir = dirname(ndir);
-	
-	if(strlen(bname) > 119 ) {
-		errno = ENAMETOOLONG;
-		return -ENAMETOOLONG;
-	}	
+		/* Parent and removed folder in stripe order */
+		dfat_dir_lock2(dir, r.index);
 
-	strcpy(r.name, bname);
+		cluster_t index = r.index;
+		laddr_t addr = dfat_lookup(dir, name, &r);
 
-	if(strcmp(odir, ndir) != 0) {
-		/*Creating record */
-		dir_record_t or;
-		dfat_create(newpath, r.flags, &or);
-		FAT[or.index].index = 0x0;
+		if(addr && r.index == index)
+		{
+			int empty = dfat_dir_empty(r.index);
+			if( empty <= 0 )
+			{
+				dfat_dir_unlock2(dir, index);
+				errno = empty ? -empty : ENOTEMPTY;
+				return empty ? empty : -ENOTEMPTY;
+			}
 
-		laddr_t naddr = dfat_find_dir_record(newpath, NULL);
-		if(naddr == 0x0) {
-			errno = ENOSPC;
-			return -ENOSPC;
+			dfat_free_chain(r.index);
+			dcache_purge(r.index);
+			dindex_drop(r.index);
+			r.name[0] = 0x0;
+			dfat_write_dir_record(addr, r);
+			dindex_remove(dir, name, addr);
+
+			dfat_dir_unlock2(dir, index);
+			return dfat_commit();
 		}
 
-		dfat_write_dir_record(naddr, r);
-		/*Deleting old record*/
-		r.name[0] = 0x0;
-		dfat_write_dir_record(addr, r);
-		return 0;
-	}
-	else {
-		dfat_write_dir_record(addr, r);
-		return 0;
+		/* Folder was replaced before lock was taken */
+		dfat_dir_unlock2(dir, index);
 	}
 }
 
+int dfat_rename(const char* path, const char* newpath)
+{
+	dir_record_t oparent, nparent;
+	char oname[SIZE_NAME], nname[SIZE_NAME];
 
-int dfat_write(const char* path, void* buf, size_t size, off_t offset)
+	if( !dfat_find_parent(path, &oparent, oname) )
+	{
+		debug("dfat_rename() %s don't exist\n", path);
+		return -errno;
+	}
+
+	if( !dfat_find_parent(newpath, &nparent, nname) )
+		return -errno;
+
+	return dfat_rename_at(oparent.index, oname, nparent.index, nname);
+}
+
+int dfat_rename_at(cluster_t odir, const char *oname, cluster_t ndir, const char *nname)
 {
-	debug("dfat_write() path=%s size=%u offset=%u\n", path, size, offset);
-	int readed = 0;
-	dir_record_t record;
-	laddr_t addr = dfat_find_dir_record(path, &record);
+	dir_record_t r, t;
+
+	if(strlen(nname) >= SIZE_NAME)
+	{
+		errno = ENAMETOOLONG;
+		return -ENAMETOOLONG;
+	}
+
+	debug("\tnew name %s\n", nname);
+	dfat_trace(DFAT_TR_RENAME, odir, ndir);
 
-	if(addr == 0) {
+	dfat_dir_lock2(odir, ndir);
+
+	laddr_t addr = dfat_lookup(odir, oname, &r);
+	
+	if(addr == 0 )
+	{
+		dfat_dir_unlock2(odir, ndir);
+		debug("dfat_rename() %s don't exist\n", oname);
 		errno = ENOENT;
 		return -ENOENT;
 	}
 
-	/* Buffer offset*/
-	off_t b_off=0;
-	/* File offset */
-	off_t f_off=0;
-	/* Integer number of  chain cluster */
-	int cluster_count = offset/sinfo.cluster_size;
-
-	/* Offset in cluster */
-	off_t cluster_offset = offset%sinfo.cluster_size;
-	debug("\tcluster chain count: %u, cluster offset: %u\n", cluster_count, cluster_offset);
-	/* Calculating file offset*/
-	f_off = offset;
-	/*Data size for read from FS*/
-	size_t write_size;
-	/* Run by cluster chain in FAT */
-	cluster_t cluster = record.index;
-	cluster_t prev_cluster;
-
-	//alocated cluster counter
-	cluster_t counter = 0;
+	laddr_t naddr = dfat_lookup(ndir, nname, &t);
 
-	for(int i=0; i<cluster_count; i++) {
-		prev_cluster = cluster;
-		cluster = FAT[cluster].index;
-		//allocate new cluster
-		if(cluster<2) {
-			counter++;
-			cluster = dfat_allocate_cluster(prev_cluster);
-			debug("\tallocated new cluster: %u\n", cluster);
-			if(cluster < 2)
-			{
-				errno = ENOSPC;
-				return -ENOSPC;
-			}
-		}
+	if(naddr == addr)
+	{
+		dfat_dir_unlock2(odir, ndir);
+		return 0;
 	}
 
-	laddr_t data_addr = dfat_cluster_offset(cluster) + cluster_offset;
-	write_size = (sinfo.cluster_size - cluster_offset > size)?(size):(sinfo.cluster_size - cluster_offset);
-	lseek(fd, data_addr, SEEK_SET);
-	int writed =  write(fd, buf, write_size);
-	b_off += writed;
-	f_off += writed;
-
-	/*Seeking for next cluster and read available data*/
-	while( size>b_off )
+	/* As POSIX rename: folder replaces only folder, file only file */
+	if(naddr && (r.flags & 0x80) != (t.flags & 0x80))
 	{
+		int err = (t.flags & 0x80) ? EISDIR : ENOTDIR;
+
+		dfat_dir_unlock2(odir, ndir);
+		errno = err;
+		return -err;
+	}
 
-		prev_cluster = cluster;
-		cluster = FAT[cluster].index;
+	if(naddr)
+	{
+		/* Replace existing target, its slot is reused */
+		if(t.flags & 0x80)
+		{
+			/* Third folder lock is out of order, back off if it is busy */
+			if( dfat_dir_trylock(t.index) )
+			{
+				dfat_dir_unlock2(odir, ndir);
+				sched_yield();
+				return dfat_rename_at(odir, oname, ndir, nname);
+			}
 
-		//alocate space, if need
-		if(cluster == 1) {
-			cluster = dfat_allocate_cluster(prev_cluster);
-			debug("\tallocated new cluster: %u\n", cluster);
-			if(cluster < 2) {
-				errno = ENOSPC;
-				return -ENOSPC;
+			int empty = dfat_dir_empty(t.index);
+			if( empty <= 0 )
+			{
+				dfat_dir_unlock(t.index);
+				dfat_dir_unlock2(odir, ndir);
+				errno = empty ? -empty : ENOTEMPTY;
+				return empty ? empty : -ENOTEMPTY;
 			}
-			counter++;
+			dcache_purge(t.index);
+			dindex_drop(t.index);
+			dfat_free_chain(t.index);
+			dfat_dir_unlock(t.index);
 		}
-		laddr_t data_addr = dfat_cluster_offset(cluster);
-		/*Calculating data size for read*/
-		write_size = ( size>(b_off+sinfo.cluster_size) )?(sinfo.cluster_size):(size-b_off);
-		/*Read data from cluster*/
+		else
+		{
+			dfat_file_wrlock2(r.index, t.index);
+			if( !dfat_file_unlinked(naddr) )
+				dfat_free_chain(t.index);
+			dfat_file_unlock2(r.index, t.index);
+		}
+	}
+	else if(odir == ndir)
+		naddr = addr;
+	else
+		naddr = dfat_find_free_dir_record(ndir);
 
-		writed =  write(fd, buf+b_off, write_size);
-		b_off += writed;
-		f_off += writed;
+	if(naddr == 0x0) {
+		dfat_dir_unlock2(odir, ndir);
+		errno = ENOSPC;
+		return -ENOSPC;
 	}
 
-	if(f_off > record.size)
+	/* Open handles must write record to its new place */
+	dfat_file_wrlock(r.index);
+
+	memset(r.name, 0, sizeof(r.name));
+	strcpy(r.name, nname);
+
+	dfat_write_dir_record(naddr, r);
+	dcache_insert(ndir, r.name, naddr, &r);
+	dindex_remove(odir, oname, addr);
+	dindex_insert(ndir, r.name, naddr);
+	dfat_file_moved(addr, naddr, r.name);
+
+	if(naddr != addr)
 	{
-		record.size = f_off;
-		dfat_write_dir_record(addr, record);
-		debug("\twritig new record at address 0x%X, new file size %u\n", addr, record.size);
+		/*Deleting old record*/
+		r.name[0] = 0x0;
+		dfat_write_dir_record(addr, r);
 	}
 
+	dfat_file_unlock(r.index);
+	dfat_dir_unlock2(odir, ndir);
+	return dfat_commit();
+}
+
+
+int dfat_write(const char* path, void* buf, size_t size, off_t offset)
+{
+	debug("dfat_write() path=%s size=%u offset=%u\n", path, size, offset);
+	dfat_file_t *f = dfat_open(path);
 
-	fdatasync(fd);
+	if(f == NULL)
+		return -errno;
 
-	debug("\twrited %u Bytes. Allocated %u clusters\n", b_off, counter);
+	int writed = dfat_file_write(f, buf, size, offset);
+	dfat_release(f);
 
-	return b_off;
+	return writed;
 }
 
 /*Read operations */
@@ -740,72 +1348,30 @@ int dfat_read_folder_by_path(const char *path, struct list* l)
 	return 0;
 }
 
-int dfat_read(const char* path, void* buf, size_t size, off_t offset)
+int dfat_readdir_path(const char *path, off_t offset, dfat_filldir_t fill, void *ctx)
 {
-	dir_record_t record;
-	laddr_t addr = dfat_find_dir_record(path, &record);
+	dir_record_t r;
 
-	if(addr == 0) {
-		errno = ENOENT;
+	if( !dfat_find_dir_record(path, &r) )
 		return -ENOENT;
-	}
-
-	if(offset>record.size)
-		return 0;
 
-	/* Buffer offset*/
-	off_t b_off=0;
-	/* File offset */
-	off_t f_off=0;
-	/* Integer number of  chain cluster */
-	int cluster_count = offset/sinfo.cluster_size;
-
-	/* Offset in cluster */
-	off_t cluster_offset = offset%sinfo.cluster_size;
-	debug("\tcluster chain count: %u, cluster offset: %u\n", cluster_count, cluster_offset);
-
-	/* Calculating file offset*/
-	f_off = offset;
-	/*Data size for read from FS*/
-	size_t read_size;
-	/* Run by cluster chain in FAT */
-	cluster_t cluster = record.index;
-
-	for(int i=0; i<cluster_count; i++) {
-		cluster = FAT[cluster].index;
-		if(cluster<2)
-			return  -1;
-	}
+	if( !(r.flags & 0x80) )
+		return -ENOTDIR;
 
-	laddr_t data_addr = dfat_cluster_offset(cluster) + cluster_offset;
-	read_size = (record.size- offset > sinfo.cluster_size - cluster_offset)?(sinfo.cluster_size - cluster_offset):(record.size-offset);
-	lseek(fd, data_addr, SEEK_SET);
-	int readed =  read(fd, buf, read_size);;
-	b_off += readed;
-	f_off += readed;
-
-	/*Seeking for next cluster and read available data*/
-	while( size>b_off && f_off<record.size )
-	{
-		cluster = FAT[cluster].index;
+	return dfat_readdir(r.index, offset, fill, ctx);
+}
 
-		if(cluster == 1)
-			return b_off;
-		debug("\treading from next cluster: %u\n", cluster);
+int dfat_read(const char* path, void* buf, size_t size, off_t offset)
+{
+	dfat_file_t *f = dfat_open(path);
 
-		laddr_t data_addr = dfat_cluster_offset(cluster);
-		/*Calculating data size for read*/
-		read_size = ( size>(b_off+sinfo.cluster_size) )?(sinfo.cluster_size):(size-b_off);
-		read_size = ((read_size+f_off)<record.size)?(read_size):(record.size-f_off);
-		/*Read data from cluster*/
+	if(f == NULL)
+		return -errno;
 
-		readed =  read(fd, buf+b_off, read_size);;
-		b_off += readed;
-		f_off += readed;
-	}
+	int readed = dfat_file_read(f, buf, size, offset);
+	dfat_release(f);
 
-	debug("dfat_read() path=%s size=%u offset=%u b_off=%u\n\tfile size = %u\n", 
-		path, size, offset, b_off, record.size);
-	return b_off;
+	debug("dfat_read() path=%s size=%u offset=%u readed=%d\n", path, size, offset, readed);
+	return readed;
 }
 /******************************************************************************************/
\ No newline at end of file
@@ -7,12 +7,153 @@
 #include <sys/fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
 #define SIZE_NAME 119
 #define LIST_SIZE 300
 #define MAX_FILE_COUNT 1024
+#define DCACHE_SIZE 1024
+/* Folders with name index */
+#define DINDEX_DIRS 64
+/* Default block cache capacity in clusters */
+#define DFAT_CACHE_SIZE 1024
+/* Default group commit interval in ms */
+#define DFAT_SYNC_INTERVAL 1000
+/* Minimal O_DIRECT alignment, raised by device requirements */
+#define DFAT_DIRECT_ALIGN 512
+/* Alignment of cluster and FAT buffers */
+#define DFAT_BUFFER_ALIGN 4096
+/* Default metadata journal size in bytes */
+#define DFAT_JOURNAL_SIZE 65536
+
+/* Durability modes, see sync.c */
+#define DFAT_SYNC_ALWAYS   0
+#define DFAT_SYNC_FSYNC    1
+#define DFAT_SYNC_PERIODIC 2
+
+/* fallocate modes, same values as Linux FALLOC_FL_* */
+#define DFAT_FALLOC_KEEP_SIZE  0x01
+#define DFAT_FALLOC_PUNCH_HOLE 0x02
+
+/* Log levels, messages above DFAT_LOG_LEVEL are compiled out */
+#define DFAT_LOG_NONE  0
+#define DFAT_LOG_ERROR 1
+#define DFAT_LOG_DEBUG 2
+
+#ifndef DFAT_LOG_LEVEL
+#define DFAT_LOG_LEVEL DFAT_LOG_ERROR
+#endif
+
+/* Trace events, see trace.c */
+enum dfat_trace_event {
+	DFAT_TR_NONE,
+	DFAT_TR_LOOKUP,     /* folder, record address or 0 */
+	DFAT_TR_READ,       /* offset, bytes read or error */
+	DFAT_TR_WRITE,      /* offset, bytes written or error */
+	DFAT_TR_TRUNCATE,   /* old size, new size */
+	DFAT_TR_CREATE,     /* parent folder, first cluster */
+	DFAT_TR_UNLINK,     /* folder, first cluster */
+	DFAT_TR_RENAME,     /* old folder, new folder */
+	DFAT_TR_ALLOC,      /* first cluster, count */
+	DFAT_TR_FREE,       /* first cluster of chain, clusters freed */
+	DFAT_TR_CACHE_MISS, /* cluster, loaded from device */
+	DFAT_TR_WRITEBACK,  /* cluster */
+	DFAT_TR_JOURNAL,    /* transaction seq, size */
+	DFAT_TR_SYNC,       /* 0, result */
+	DFAT_TR_EVENTS
+};
+
+/* Operations with statistics, see stats.c */
+enum dfat_op {
+	DFAT_OP_LOOKUP,
+	DFAT_OP_READ,
+	DFAT_OP_WRITE,
+	DFAT_OP_CREATE,
+	DFAT_OP_UNLINK,
+	DFAT_OP_READDIR,
+	DFAT_OP_ALLOC,
+	DFAT_OP_SYNC,
+	/* Device I/O outside of operations */
+	DFAT_OP_OTHER,
+	DFAT_OPS
+};
+
+struct dfat_op_timer {
+	int op;
+	int outer;
+	unsigned long start;
+};
+
+/* Trace file: header, then records of all threads in no particular order */
+#define DFAT_TRACE_MAGIC 0x52544644
+
+struct dfat_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;
+};
+
+struct dfat_trace_record {
+	/* CLOCK_MONOTONIC, ns */
+	uint64_t time;
+	uint32_t event;
+	uint32_t tid;
+	uint64_t a;
+	uint64_t b;
+};
+
+/* FUSE callbacks of workload capture, see capture.c */
+enum dfat_capture_op {
+	DFAT_CAP_LOOKUP,
+	DFAT_CAP_FORGET,
+	DFAT_CAP_GETATTR,
+	DFAT_CAP_SETATTR,   /* flags: size is set */
+	DFAT_CAP_MKDIR,
+	DFAT_CAP_UNLINK,
+	DFAT_CAP_RMDIR,
+	DFAT_CAP_RENAME,    /* old path, 0, new path */
+	DFAT_CAP_OPEN,      /* flags: open flags */
+	DFAT_CAP_CREATE,    /* flags: open flags */
+	DFAT_CAP_READ,
+	DFAT_CAP_WRITE,
+	DFAT_CAP_FLUSH,
+	DFAT_CAP_RELEASE,
+	DFAT_CAP_FSYNC,     /* flags: datasync */
+	DFAT_CAP_READDIR,
+	DFAT_CAP_FALLOCATE, /* flags: mode */
+	DFAT_CAP_OPS
+};
 
-#define DEBUG 1
+/* Capture file: header, then records in order of completion */
+#define DFAT_CAPTURE_MAGIC 0x50434644
+
+struct dfat_capture_header {
+	uint32_t magic;
+	uint32_t version;
+	/* CLOCK_REALTIME of capture start, ns */
+	uint64_t start;
+};
+
+/* path_len of record whose paths did not fit, no path follows it */
+#define DFAT_CAPTURE_OVERSIZE UINT16_MAX
+
+/* Record is followed by path_len bytes of path, no terminating 0 */
+struct dfat_capture_record {
+	/* ns since capture start */
+	uint64_t start;
+	/* ns the callback took, reply included */
+	uint32_t duration;
+	uint16_t op;
+	uint16_t path_len;
+	/* Open file handle, 0 if none */
+	uint64_t fh;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t flags;
+	uint32_t tid;
+};
 
 typedef unsigned long laddr_t;
 typedef unsigned int cluster_t;
@@ -64,7 +205,73 @@ struct superblock_info
 	cluster_t fat_size;
 	/* File System Label 80 bytes*/
 	char label[80];
+	/* Metadata journal size after FAT, 0 - no journal: 4 bytes. Without
+	 * journal file system is not crash consistent: evicted folder clusters
+	 * may reach device before FAT that links them */
+	cluster_t journal_size;
+
+};
 
+/* Run of physically contiguous clusters of file */
+struct dfat_extent
+{
+	/* Index of first cluster in file */
+	cluster_t logical;
+	cluster_t physical;
+	cluster_t length;
+};
+
+/* Open file, shared by all handles of one dir record */
+typedef struct dfat_file
+{
+	/* Dir record linear address */
+	laddr_t addr;
+	/* Cached dir record, size is kept here while file is open */
+	dir_record_t record;
+	/* First cluster, key of file lock */
+	cluster_t first;
+	/* Open handles count */
+	unsigned int refs;
+	/* Record deleted, chain is freed at last release */
+	int unlinked;
+	/* Extent map of chain, built on first access */
+	struct dfat_extent *extents;
+	unsigned int extents_count;
+	unsigned int extents_size;
+	/* Clusters covered by map */
+	cluster_t clusters;
+	int map_valid;
+	/* Readers build map concurrently under shared file lock */
+	pthread_mutex_t map_lock;
+	struct dfat_file *next;
+} dfat_file_t;
+
+/* Vectored request of I/O batch */
+struct dfat_io
+{
+	struct iovec *iov;
+	int iovcnt;
+	laddr_t offset;
+	int write;
+	/* Transferred bytes or -errno */
+	ssize_t res;
+};
+
+/* Device backend, see backend.c */
+struct dfat_backend
+{
+	const char *name;
+	int (*open)(const char *device);
+	ssize_t (*read_at)(void *buf, size_t size, laddr_t offset);
+	ssize_t (*write_at)(const void *buf, size_t size, laddr_t offset);
+	ssize_t (*writev_at)(const struct iovec *iov, int count, laddr_t offset);
+	int (*sync)();
+	laddr_t (*size)();
+	void (*close)();
+	/* Run batch of requests, results are in io[i].res */
+	int (*submit)(struct dfat_io *io, int count);
+	/* Optional, buffer used by most requests, NULL drops it */
+	int (*register_buffer)(void *base, size_t size);
 };
 
 /* list for folder items */
@@ -76,6 +283,7 @@ struct list {
 
 struct superblock_info sinfo;
 int fd;
+struct dfat_backend *backend;
 char *device_file;
 
 
@@ -83,26 +291,218 @@ struct fat_record *FAT;
 cluster_t fat_count;
 
 /*STD debug*/
-void debug(const char *format, ...);
-void error(const char *format, ...);
+void dfat_log(int level, const char *format, ...);
+
+#if DFAT_LOG_LEVEL >= DFAT_LOG_DEBUG
+#define debug(...) dfat_log(DFAT_LOG_DEBUG, __VA_ARGS__)
+#else
+#define debug(...) ((void) 0)
+#endif
+
+#if DFAT_LOG_LEVEL >= DFAT_LOG_ERROR
+#define error(...) dfat_log(DFAT_LOG_ERROR, __VA_ARGS__)
+#else
+#define error(...) ((void) 0)
+#endif
+
+/*Binary trace, off until dfat_trace_start(). -DDFAT_NO_TRACE compiles trace points out */
+extern int dfat_tracing;
+void dfat_trace_event(unsigned int event, uint64_t a, uint64_t b);
+
+#ifdef DFAT_NO_TRACE
+#define dfat_trace(event, a, b) ((void) 0)
+#else
+#define dfat_trace(event, a, b) do { \
+	if(__builtin_expect(__atomic_load_n(&dfat_tracing, __ATOMIC_RELAXED), 0)) \
+		dfat_trace_event(event, a, b); \
+	} while(0)
+#endif
+
+void dfat_trace_start();
+void dfat_trace_stop();
+/* Write events of current trace to file, return their count or -errno */
+long dfat_trace_dump(const char *path);
+const char *dfat_trace_name(unsigned int event);
+
+/*Workload capture */
+int dfat_capture_start(const char *path);
+void dfat_capture_stop();
+/* ns since capture start */
+uint64_t dfat_capture_clock();
+/* Append record, path2 is new path of rename or NULL */
+void dfat_capture(struct dfat_capture_record *r, const char *path, const char *path2);
+/* Next record of capture file, path gets both paths. Return 1, 0 at end or -errno */
+int dfat_capture_read(FILE *in, struct dfat_capture_record *r, char *path, size_t size);
+const char *dfat_capture_name(unsigned int op);
+
+/*Operation statistics */
+void dfat_stats_begin(struct dfat_op_timer *t, int op);
+void dfat_stats_end(struct dfat_op_timer *t, int res);
+void dfat_stats_io(unsigned int syscalls, ssize_t bytes, int write);
+void dfat_stats_extents(unsigned int count);
+void dfat_stats_reset();
+/* Text report, return its length like snprintf() */
+size_t dfat_stats_format(char *buf, size_t size);
+
 /*Functions for work with files list */
 void list_append(dir_record_t r, struct list* l);
 void list_clear(struct list *l);
 
+/*Dentry cache */
+void dcache_clear();
+/* Return 1 if (parent, name) cached, *addr = 0 for negative entry */
+int dcache_lookup(cluster_t parent, const char *name, dir_record_t *out_record, laddr_t *addr);
+/* Cache record at addr, addr = 0 caches that name is absent */
+void dcache_insert(cluster_t parent, const char *name, laddr_t addr, const dir_record_t *r);
+/* Stamp for dcache_insert_stamped() */
+unsigned long dcache_stamp();
+/* Cache record read from device, skipped if any record was written since stamp */
+void dcache_insert_stamped(unsigned long stamp, cluster_t parent, const char *name,
+                           laddr_t addr, const dir_record_t *r);
+/* Record at addr was rewritten */
+void dcache_update(laddr_t addr, const dir_record_t *r);
+/* Forget entries of folder */
+void dcache_purge(cluster_t parent);
+
+/*Directory index, callers hold folder lock */
+void dindex_clear();
+/* Return 1 if folder is indexed, *addr = 0 if name is absent */
+int dindex_lookup(cluster_t dir, const char *name, dir_record_t *out_record, laddr_t *addr);
+/* Return 1 if folder is indexed, *addr = 0 if it is full and must grow after *last */
+int dindex_free_slot(cluster_t dir, laddr_t *addr, cluster_t *last);
+/* Record with name written at or deleted from addr */
+void dindex_insert(cluster_t dir, const char *name, laddr_t addr);
+void dindex_remove(cluster_t dir, const char *name, laddr_t addr);
+/* Cleared cluster appended to folder */
+void dindex_grow(cluster_t dir, cluster_t cluster);
+/* Forget index of removed folder */
+void dindex_drop(cluster_t dir);
+
+/*Free clusters bitmap */
+int bitmap_load();
+void bitmap_close();
+/* FAT record of cluster changed from old to new value at journal mark */
+void bitmap_update(cluster_t cluster, cluster_t old, cluster_t new, unsigned long long mark);
+/* Free clusters held till their free is committed, return their count */
+cluster_t bitmap_reclaim(int force);
+/* Free cluster at or after from, 0 if not free space */
+cluster_t bitmap_find_free(cluster_t from);
+cluster_t bitmap_free_count();
+/* Length of free run at start, not more than max */
+cluster_t bitmap_run(cluster_t start, cluster_t max);
+/* Smallest free extent of count clusters or the largest one if there is no such */
+cluster_t bitmap_best_fit(cluster_t count, cluster_t *length);
+
+/*Device backends: "pread" (default), "mmap", "mem", "uring" */
+/* Set before dfat_load(), return -1 for unknown name */
+int dfat_set_backend(const char *name);
+/* NULL if io_uring is not supported by build */
+struct dfat_backend *dfat_uring_backend();
+/* Open device by pread and uring backends with O_DIRECT, set before dfat_load() */
+void dfat_set_direct(int on);
+int dfat_open_device(const char *device);
+/* Return 1 if request needs no bounce buffer */
+int dfat_io_aligned(const void *buf, size_t size, laddr_t offset);
+/* Transfer through aligned bounce buffer, partial sectors are read-modify-written */
+ssize_t dfat_direct_rw(void *buf, size_t size, laddr_t offset, int write);
+
+/*Write-back cluster cache */
+/* Capacity in clusters, set before dfat_load() */
+void dfat_set_cache_size(unsigned int clusters);
+int dfat_cache_init();
+void dfat_cache_close();
+/* Read/write size bytes at offset of cluster through cache */
+int dfat_cache_read(cluster_t cluster, off_t offset, void *buf, size_t size);
+int dfat_cache_write(cluster_t cluster, off_t offset, const void *buf, size_t size);
+/* Keep cache coherent with direct transfer of count whole clusters */
+int dfat_cache_prepare(cluster_t cluster, cluster_t count, int write);
+/* Drop cached clusters without write back */
+void dfat_cache_invalidate(cluster_t cluster, cluster_t count);
+/* Write back dirty clusters, after their journal entries are committed */
+int dfat_cache_flush();
+/* Same for checkpoint, in place even if journal is full */
+int dfat_cache_checkpoint();
+
+/*Durability */
+/* Mode and group commit interval, set before dfat_load() */
+void dfat_set_sync_mode(int mode, unsigned int interval_ms);
+int dfat_sync_mode();
+/* Make all completed operations durable */
+int dfat_sync();
+/* Called at end of modifying operation, syncs in always mode */
+int dfat_commit();
+int dfat_sync_start();
+void dfat_sync_stop();
+
+/*Metadata journal */
+/* Replay committed transactions into loaded FAT and folders */
+int dfat_journal_replay();
+void dfat_journal_close();
+/* Return mark of change, durable when dfat_journal_committed() reaches it */
+unsigned long long dfat_journal_fat(cluster_t cluster, cluster_t next);
+void dfat_journal_record(laddr_t addr, const dir_record_t *r);
+void dfat_journal_zero(cluster_t cluster);
+/* Append pending batch, -ENOSPC if journal is full */
+int dfat_journal_commit();
+/* Return 1 if journal needs checkpoint */
+int dfat_journal_full();
+/* Write metadata in place and empty journal */
+int dfat_journal_checkpoint();
+unsigned long long dfat_journal_committed();
+/* Commit FAT changes under fat lock, in place without journal */
+int dfat_journal_force();
+
+/*Locks, see lock.c for order */
+void dfat_locks_init();
+void dfat_fat_lock();
+void dfat_fat_unlock();
+void dfat_dir_lock(cluster_t cluster);
+int dfat_dir_trylock(cluster_t cluster);
+void dfat_dir_unlock(cluster_t cluster);
+void dfat_dir_lock2(cluster_t a, cluster_t b);
+void dfat_dir_unlock2(cluster_t a, cluster_t b);
+void dfat_file_rdlock(cluster_t cluster);
+void dfat_file_wrlock(cluster_t cluster);
+void dfat_file_unlock(cluster_t cluster);
+void dfat_file_wrlock2(cluster_t a, cluster_t b);
+void dfat_file_unlock2(cluster_t a, cluster_t b);
+
 /*Init FS*/
 int dfat_load(const char *device);
 
 void dfat_close();
 
+/*Write empty FS to device, return 0 or -errno */
+int dfat_format(const char *device, unsigned short sector_size, unsigned short cluster_size,
+                const char *label, cluster_t journal_size);
+
 /*Init FAT*/
 int dfat_fat_load();
 
+/*Write changed FAT pages to device, called under fat lock */
+int dfat_fat_write();
+
+/*Mark FAT page of cluster as changed */
+void dfat_fat_dirty(cluster_t cluster);
+
 /*Geting directory record from cluster cluster_num with record_num */
 dir_record_t dfat_read_dir_record(cluster_t cluster_num, unsigned char record_num);
 
+/*Read directory record at linear address */
+int dfat_read_record(laddr_t addr, dir_record_t *r);
+
+/*Read all directory records of cluster cluster_num by one call */
+int dfat_read_dir_cluster(cluster_t cluster_num, dir_record_t *records);
+
+/*Fill cluster by zeroes */
+int dfat_clear_cluster(cluster_t cluster_num);
+
 /*Get 2 cluster offset*/
 laddr_t dfat_cluster_offset(cluster_t cluster_num);
 
+/*Cluster of linear address */
+cluster_t dfat_addr_cluster(laddr_t addr);
+
 /*Writing directory record from cluster cluster_num with record_num */
 int dfat_write_dir_record(laddr_t addr, dir_record_t r);
 
@@ -112,6 +512,15 @@ void dfat_print_fat();
 /*Read directory entries*/
 /* Function allocate memory and return array of dir_record_t */
 struct list *dfat_read_folder(cluster_t, struct list*);
+/* Called for every record of folder with offset of next one, nonzero stops reading */
+typedef int (*dfat_filldir_t)(void *ctx, const dir_record_t *r, off_t next);
+/* Feed records of folder starting at offset, 0 - from the first one */
+int dfat_readdir(cluster_t cluster_num, off_t offset, dfat_filldir_t fill, void *ctx);
+/* Return 1 if folder has no records, 0 if it has some, -EIO on read error */
+int dfat_dir_empty(cluster_t cluster_num);
+
+/*Looking for dir record by name in folder with first cluster cluster_num */
+laddr_t dfat_lookup(cluster_t cluster_num, const char *name, dir_record_t *out_record);
 
 /*Looking for dir record by full name*/
 laddr_t dfat_find_dir_record(const char* path, dir_record_t *out_record);
@@ -126,8 +535,21 @@ laddr_t dfat_find_free_dir_record(cluster_t cluster_num);
 /* Separate path to array. Return array size */
 int dfat_get_path(const char *path, char** separated);
 
+/* Update FAT record of cluster */
+void dfat_fat_set(cluster_t cluster, cluster_t next);
+
 cluster_t dfat_allocate_cluster(cluster_t prev_cluster);
 
+/* Allocate up to count contiguous clusters and link them after prev_cluster */
+/* Return first cluster, *allocated - length of run, 0 if not free space */
+cluster_t dfat_allocate_clusters(cluster_t prev_cluster, cluster_t count, cluster_t *allocated);
+
+/* Append count clusters to chain with last cluster last, return 0 or -ENOSPC */
+int dfat_extend_chain(cluster_t last, cluster_t count);
+
+/* Free chain started at first, return count of freed clusters */
+cluster_t dfat_free_chain(cluster_t first);
+
 /* Take a new cluster */
 /* Return cluster number 
  * if not free space:	0
@@ -141,16 +563,54 @@ cluster_t dfat_find_free_cluster(cluster_t cluster_num/*Prev cluster*/);
  size_t dfat_free_space();
  size_t dfat_total_space();
 
+/* Looking for parent folder record of path, copy last path element to name */
+laddr_t dfat_find_parent(const char *path, dir_record_t *parent, char *name);
+
+/* Find file record and take its lock, return record address */
+laddr_t dfat_lock_file(const char *path, dir_record_t *record, int write);
+
 /* Write operations */
 /****/
 int dfat_create(const char* path, byte_t flags, dir_record_t *r);
 int dfat_rmdir(const char* path);
 int dfat_unlink(const char* path);
 int dfat_rename(const char* path, const char* newpath);
+/* Same by first cluster of folder and name, without path resolution */
+int dfat_create_at(cluster_t parent, const char *name, byte_t flags, dir_record_t *r);
+int dfat_rmdir_at(cluster_t parent, const char *name);
+int dfat_unlink_at(cluster_t parent, const char *name);
+int dfat_rename_at(cluster_t oparent, const char *oname, cluster_t nparent, const char *nname);
 int dfat_write(const char* path, void* buf, size_t size, off_t offset);
 /*****/
 
 int dfat_read_folder_by_path(const char *path, struct list* l);
+int dfat_readdir_path(const char *path, off_t offset, dfat_filldir_t fill, void *ctx);
 int dfat_read(const char* path, void* buf, size_t size, off_t offset);
 
+/* Open files */
+/****/
+/* Resolve path once, return shared open file or NULL */
+dfat_file_t *dfat_open(const char *path);
+/* Same by record address from dfat_lookup() */
+dfat_file_t *dfat_open_at(laddr_t addr);
+void dfat_release(dfat_file_t *f);
+int dfat_file_read(dfat_file_t *f, void *buf, size_t size, off_t offset);
+int dfat_file_write(dfat_file_t *f, const void *buf, size_t size, off_t offset);
+int dfat_file_truncate(dfat_file_t *f, off_t length);
+int dfat_truncate(const char *path, off_t length);
+/* mode is 0 or DFAT_FALLOC_* flags, mode 0 past end of file is EOPNOTSUPP */
+int dfat_file_fallocate(dfat_file_t *f, int mode, off_t offset, off_t length);
+/* Record deleted, return 1 if file is open and chain freeing is deferred */
+int dfat_file_unlinked(laddr_t addr);
+/* Record moved by rename */
+void dfat_file_moved(laddr_t addr, laddr_t naddr, const char *name);
+/* Change generation of file by first cluster, differs after every change of data or size */
+void dfat_file_changed(cluster_t first);
+unsigned long dfat_file_generation(cluster_t first);
+int dfat_file_init();
+void dfat_file_close();
+void dfat_file_born(cluster_t first);
+unsigned long dfat_file_birth(cluster_t first);
+/*****/
+
 #endif
\ No newline at end of file
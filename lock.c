@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <pthread.h>
+
+/* Locking design:
+ *   fat_lock   - FAT records, free clusters bitmap and allocation
+ *   dir_locks  - folder contents, striped by first cluster of folder
+ *   file_locks - file data and size, striped by first cluster of file
+ * Order: dir (two dirs in stripe order) -> file -> fat. dcache and block
+ * cache have own leaf locks, directory index lock goes before block cache. */
+
+#define DIR_LOCKS 64
+#define FILE_LOCKS 256
+
+static pthread_mutex_t fat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dir_locks[DIR_LOCKS];
+static pthread_rwlock_t file_locks[FILE_LOCKS];
+static pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+static void dfat_locks_create()
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	/* Create holds folder lock while looking up in the same folder */
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+	for(int i = 0; i < DIR_LOCKS; i++)
+		pthread_mutex_init(&dir_locks[i], &attr);
+
+	for(int i = 0; i < FILE_LOCKS; i++)
+		pthread_rwlock_init(&file_locks[i], NULL);
+
+	pthread_mutexattr_destroy(&attr);
+}
+
+void dfat_locks_init()
+{
+	pthread_once(&locks_once, dfat_locks_create);
+}
+
+void dfat_fat_lock()
+{
+	pthread_mutex_lock(&fat_lock);
+}
+
+void dfat_fat_unlock()
+{
+	pthread_mutex_unlock(&fat_lock);
+}
+
+void dfat_dir_lock(cluster_t cluster)
+{
+	pthread_mutex_lock(&dir_locks[cluster % DIR_LOCKS]);
+}
+
+/* Return 0 if lock was taken */
+int dfat_dir_trylock(cluster_t cluster)
+{
+	return pthread_mutex_trylock(&dir_locks[cluster % DIR_LOCKS]);
+}
+
+void dfat_dir_unlock(cluster_t cluster)
+{
+	pthread_mutex_unlock(&dir_locks[cluster % DIR_LOCKS]);
+}
+
+/* Lock two folders in stripe order */
+void dfat_dir_lock2(cluster_t a, cluster_t b)
+{
+	unsigned int la = a % DIR_LOCKS, lb = b % DIR_LOCKS;
+
+	if(la == lb)
+	{
+		pthread_mutex_lock(&dir_locks[la]);
+		return;
+	}
+
+	pthread_mutex_lock(&dir_locks[la < lb ? la : lb]);
+	pthread_mutex_lock(&dir_locks[la < lb ? lb : la]);
+}
+
+void dfat_dir_unlock2(cluster_t a, cluster_t b)
+{
+	pthread_mutex_unlock(&dir_locks[a % DIR_LOCKS]);
+	if(a % DIR_LOCKS != b % DIR_LOCKS)
+		pthread_mutex_unlock(&dir_locks[b % DIR_LOCKS]);
+}
+
+void dfat_file_rdlock(cluster_t cluster)
+{
+	pthread_rwlock_rdlock(&file_locks[cluster % FILE_LOCKS]);
+}
+
+void dfat_file_wrlock(cluster_t cluster)
+{
+	pthread_rwlock_wrlock(&file_locks[cluster % FILE_LOCKS]);
+}
+
+void dfat_file_unlock(cluster_t cluster)
+{
+	pthread_rwlock_unlock(&file_locks[cluster % FILE_LOCKS]);
+}
+
+/* Lock two files in stripe order */
+void dfat_file_wrlock2(cluster_t a, cluster_t b)
+{
+	unsigned int la = a % FILE_LOCKS, lb = b % FILE_LOCKS;
+
+	if(la == lb)
+	{
+		pthread_rwlock_wrlock(&file_locks[la]);
+		return;
+	}
+
+	pthread_rwlock_wrlock(&file_locks[la < lb ? la : lb]);
+	pthread_rwlock_wrlock(&file_locks[la < lb ? lb : la]);
+}
+
+void dfat_file_unlock2(cluster_t a, cluster_t b)
+{
+	pthread_rwlock_unlock(&file_locks[a % FILE_LOCKS]);
+	if(a % FILE_LOCKS != b % FILE_LOCKS)
+		pthread_rwlock_unlock(&file_locks[b % FILE_LOCKS]);
+}
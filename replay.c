@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include "libdfat.h"
+
+/* Replay of fusedfat capture against libdfat */
+/* Records are replayed one by one in file order, by path, so capture of
+ * a mount over empty image replays on a fresh one and capture of any other
+ * mount replays on a copy of the image it started from. Open handles of
+ * capture map to dfat_file_t. Records start at their original time unless
+ * -f is given, concurrent callbacks of capture are serialized. Summary
+ * compares time of every callback in capture with time of its replay. */
+
+#define HANDLE_BUCKETS 1024
+
+struct replay_config {
+	int fast;
+	int print;
+	const char *snapshot;
+	unsigned int image_mb;
+	unsigned short cluster_size;
+	const char *backend;
+	int verbose;
+};
+
+/* Library shares one dfat_file_t among opens of a file, so capture has the
+ * same fh for all of them: every open holds a reference until its release */
+struct replay_handle {
+	uint64_t fh;
+	dfat_file_t *f;
+	unsigned int opens;
+	struct replay_handle *next;
+};
+
+struct replay_stats {
+	unsigned long count;
+	unsigned long errors;
+	uint64_t captured_ns;
+	uint64_t replayed_ns;
+	uint64_t max_ns;
+};
+
+static struct replay_handle *handles[HANDLE_BUCKETS];
+static struct replay_stats stats[DFAT_CAP_OPS];
+static char *data;
+static size_t data_size;
+
+static int replay_usage()
+{
+	printf("dfat-replay [-f] [-p] [-s <snapshot>] [-n <MB> [-c <cluster size>]] [-b <backend>] [-v]\n"
+	       "            <capture> <image>\n"
+	       "\t-f  as fast as possible, default keeps original timing\n"
+	       "\t-p  print records of capture, nothing is replayed\n"
+	       "\t-s  copy snapshot to image first\n"
+	       "\t-n  format fresh image of size first\n"
+	       "\t-v  libdfat statistics to stderr\n");
+	return -1;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* Open handles */
+/******************************************************************************************/
+static struct replay_handle **handle_find(uint64_t fh)
+{
+	struct replay_handle **p = &handles[(fh >> 4) % HANDLE_BUCKETS];
+
+	while(*p != NULL && (*p)->fh != fh)
+		p = &(*p)->next;
+
+	return p;
+}
+
+static dfat_file_t *handle_get(uint64_t fh)
+{
+	struct replay_handle *h = *handle_find(fh);
+
+	return (h != NULL) ? h->f : NULL;
+}
+
+static int handle_add(uint64_t fh, dfat_file_t *f)
+{
+	struct replay_handle **p = handle_find(fh);
+
+	/* Same file opened again, or by replay */
+	if(*p != NULL && (*p)->f == f)
+	{
+		dfat_release(f);
+		(*p)->opens++;
+		return 0;
+	}
+
+	/* Handle of capture is reused by another file, its releases were not captured */
+	if(*p != NULL)
+	{
+		dfat_release((*p)->f);
+		(*p)->f = f;
+		(*p)->opens = 1;
+		return 0;
+	}
+
+	if((*p = malloc(sizeof(struct replay_handle))) == NULL)
+		return -ENOMEM;
+
+	(*p)->fh = fh;
+	(*p)->f = f;
+	(*p)->opens = 1;
+	(*p)->next = NULL;
+	return 0;
+}
+
+/* File is closed at release of its last open */
+static int handle_release(uint64_t fh)
+{
+	struct replay_handle **p = handle_find(fh);
+	struct replay_handle *h = *p;
+
+	if(h == NULL)
+		return -EBADF;
+
+	if(--h->opens)
+		return 0;
+
+	*p = h->next;
+	dfat_release(h->f);
+	free(h);
+	return 0;
+}
+
+static void handle_release_all()
+{
+	for(unsigned int i = 0; i < HANDLE_BUCKETS; i++)
+	{
+		while(handles[i] != NULL)
+		{
+			handles[i]->opens = 1;
+			handle_release(handles[i]->fh);
+		}
+	}
+}
+
+/* Operations */
+/******************************************************************************************/
+static int data_reserve(size_t size)
+{
+	if(size <= data_size)
+		return 0;
+
+	char *buf = realloc(data, size);
+	if(buf == NULL)
+		return -ENOMEM;
+
+	for(size_t i = data_size; i < size; i++)
+		buf[i] = i*31 + (i >> 12);
+
+	data = buf;
+	data_size = size;
+	return 0;
+}
+
+/* Readdir fills reply buffer of kernel, entries are sized like fuse_add_direntry() */
+struct replay_dirbuf {
+	size_t size;
+	size_t used;
+};
+
+static int replay_fill(void *ctx, const dir_record_t *r, off_t next)
+{
+	struct replay_dirbuf *d = ctx;
+	size_t n = (24 + strlen(r->name) + 7) & ~(size_t) 7;
+
+	if(n > d->size - d->used)
+		return 1;
+
+	d->used += n;
+	return 0;
+}
+
+/* Open file of record, by path if its open was not captured */
+static dfat_file_t *replay_file(struct dfat_capture_record *r, const char *path)
+{
+	dfat_file_t *f = handle_get(r->fh);
+
+	if(f == NULL && path[0] && (f = dfat_open(path)) != NULL && handle_add(r->fh, f) < 0)
+	{
+		dfat_release(f);
+		f = NULL;
+	}
+
+	return f;
+}
+
+static int replay_open(struct dfat_capture_record *r, const char *path)
+{
+	dfat_file_t *f = dfat_open(path);
+	if(f == NULL)
+		return -errno;
+
+	if(handle_add(r->fh, f) < 0)
+	{
+		dfat_release(f);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Return result of library call, -ENOENT if there was nothing to call it on */
+static int replay_record(struct dfat_capture_record *r, const char *path)
+{
+	dir_record_t rec;
+	dfat_file_t *f;
+	int res;
+
+	switch(r->op)
+	{
+		case DFAT_CAP_FORGET:
+			return 0;
+		case DFAT_CAP_LOOKUP:
+			return (path[0] && dfat_find_dir_record(path, &rec)) ? 0 : -ENOENT;
+		case DFAT_CAP_GETATTR:
+			/* Attributes of open file come from its handle */
+			if(r->fh && handle_get(r->fh) != NULL)
+				return 0;
+			return (path[0] && dfat_find_dir_record(path, &rec)) ? 0 : -ENOENT;
+		case DFAT_CAP_SETATTR:
+			if(!r->flags)
+				return 0;
+			if(r->fh && (f = handle_get(r->fh)) != NULL)
+				return dfat_file_truncate(f, r->size);
+			return path[0] ? dfat_truncate(path, r->size) : -ENOENT;
+		case DFAT_CAP_MKDIR:
+			return path[0] ? dfat_create(path, 0x80, NULL) : -ENOENT;
+		case DFAT_CAP_UNLINK:
+			return path[0] ? dfat_unlink(path) : -ENOENT;
+		case DFAT_CAP_RMDIR:
+			return path[0] ? dfat_rmdir(path) : -ENOENT;
+		case DFAT_CAP_RENAME:
+		{
+			const char *newpath = path + strlen(path) + 1;
+			return (path[0] && newpath[0]) ? dfat_rename(path, newpath) : -ENOENT;
+		}
+		case DFAT_CAP_OPEN:
+			return path[0] ? replay_open(r, path) : -ENOENT;
+		case DFAT_CAP_CREATE:
+			if(!path[0])
+				return -ENOENT;
+			if((res = dfat_create(path, 0x0, NULL)) < 0)
+				return res;
+			return replay_open(r, path);
+		case DFAT_CAP_READ:
+			if((f = replay_file(r, path)) == NULL)
+				return -EBADF;
+			if(data_reserve(r->size) < 0)
+				return -ENOMEM;
+			return dfat_file_read(f, data, r->size, r->offset);
+		case DFAT_CAP_WRITE:
+			if((f = replay_file(r, path)) == NULL)
+				return -EBADF;
+			if(data_reserve(r->size) < 0)
+				return -ENOMEM;
+			return dfat_file_write(f, data, r->size, r->offset);
+		case DFAT_CAP_FLUSH:
+			return dfat_cache_flush();
+		case DFAT_CAP_RELEASE:
+			return handle_release(r->fh);
+		case DFAT_CAP_FSYNC:
+			return dfat_sync();
+		case DFAT_CAP_READDIR:
+		{
+			struct replay_dirbuf d = { r->size, 0 };
+			return path[0] ? dfat_readdir_path(path, r->offset, replay_fill, &d) : -ENOENT;
+		}
+		case DFAT_CAP_FALLOCATE:
+			if((f = replay_file(r, path)) == NULL)
+				return -EBADF;
+			return dfat_file_fallocate(f, r->flags, r->offset, r->size);
+	}
+
+	return -ENOSYS;
+}
+
+/* Image */
+/******************************************************************************************/
+static int copy_snapshot(const char *snapshot, const char *image)
+{
+	int in = open(snapshot, O_RDONLY);
+	if(in < 0)
+		return -errno;
+
+	int out = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out < 0)
+	{
+		close(in);
+		return -errno;
+	}
+
+	char *buf = malloc(1 << 20);
+	ssize_t n = 0;
+	int res = (buf == NULL) ? -ENOMEM : 0;
+
+	while(res == 0 && (n = read(in, buf, 1 << 20)) > 0)
+	{
+		if(write(out, buf, n) != n)
+			res = -EIO;
+	}
+	if(res == 0 && n < 0)
+		res = -errno;
+	if(res == 0 && fsync(out) < 0)
+		res = -errno;
+
+	free(buf);
+	close(in);
+	close(out);
+	return res;
+}
+
+static int fresh_image(const char *image, unsigned int image_mb, unsigned short cluster_size)
+{
+	int dev = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(dev < 0 || ftruncate(dev, (off_t) image_mb << 20) < 0)
+	{
+		int res = -errno;
+		if(dev >= 0)
+			close(dev);
+		return res;
+	}
+	close(dev);
+
+	return dfat_format(image, 512, cluster_size, "replay", DFAT_JOURNAL_SIZE);
+}
+
+/******************************************************************************************/
+static int replay_header(FILE *in, const char *path)
+{
+	struct dfat_capture_header h;
+
+	if(fread(&h, sizeof(h), 1, in) != 1 || h.magic != DFAT_CAPTURE_MAGIC || h.version != 1)
+	{
+		fprintf(stderr, "%s: not a dfat capture\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int replay_print(FILE *in)
+{
+	struct dfat_capture_record r;
+	char path[2*PATH_MAX + 2];
+	int res;
+
+	while((res = dfat_capture_read(in, &r, path, sizeof(path))) > 0)
+	{
+		printf("%14.3f %10.3f %7u %-9s %#14llx %12llu %10llu %#6x %s", r.start/1000.0, r.duration/1000.0,
+		       r.tid, dfat_capture_name(r.op), (unsigned long long) r.fh, (unsigned long long) r.offset,
+		       (unsigned long long) r.size, r.flags,
+		       (r.path_len == DFAT_CAPTURE_OVERSIZE) ? "<path too long>" : path);
+		if(r.op == DFAT_CAP_RENAME)
+			printf(" -> %s", path + strlen(path) + 1);
+		printf("\n");
+	}
+
+	return res;
+}
+
+static void replay_summary(unsigned long records, uint64_t captured, uint64_t replayed, uint64_t lag)
+{
+	printf("%lu records, captured %.3f ms, replayed %.3f ms", records, captured/1000000.0, replayed/1000000.0);
+	if(lag)
+		printf(", max lag %.3f ms", lag/1000000.0);
+	printf("\n");
+
+	printf("%-9s %10s %8s %14s %14s %12s %12s %12s\n", "op", "count", "errors",
+	       "captured_ms", "replayed_ms", "captured_us", "replayed_us", "max_us");
+
+	for(unsigned int op = 0; op < DFAT_CAP_OPS; op++)
+	{
+		struct replay_stats *s = &stats[op];
+		if(s->count == 0)
+			continue;
+
+		printf("%-9s %10lu %8lu %14.3f %14.3f %12.2f %12.2f %12.2f\n", dfat_capture_name(op),
+		       s->count, s->errors, s->captured_ns/1000000.0, s->replayed_ns/1000000.0,
+		       s->captured_ns/1000.0/s->count, s->replayed_ns/1000.0/s->count, s->max_ns/1000.0);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	struct replay_config conf = { 0, 0, NULL, 0, 4096, "pread", 0 };
+	int i;
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i++)
+	{
+		if(strcmp("-f", argv[i]) == 0)
+			conf.fast = 1;
+		else if(strcmp("-p", argv[i]) == 0)
+			conf.print = 1;
+		else if(strcmp("-s", argv[i]) == 0 && i + 1 < argc)
+			conf.snapshot = argv[++i];
+		else if(strcmp("-n", argv[i]) == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%u", &conf.image_mb);
+		else if(strcmp("-c", argv[i]) == 0 && i + 1 < argc)
+			sscanf(argv[++i], "%hu", &conf.cluster_size);
+		else if(strcmp("-b", argv[i]) == 0 && i + 1 < argc)
+			conf.backend = argv[++i];
+		else if(strcmp("-v", argv[i]) == 0)
+			conf.verbose = 1;
+		else
+			return replay_usage();
+	}
+
+	if(i + (conf.print ? 1 : 2) != argc || (conf.snapshot != NULL && conf.image_mb))
+		return replay_usage();
+
+	const char *capture = argv[i];
+	const char *image = argv[i + 1];
+
+	FILE *in = fopen(capture, "rb");
+	if(in == NULL)
+	{
+		perror(capture);
+		return -2;
+	}
+
+	if(replay_header(in, capture) < 0)
+	{
+		fclose(in);
+		return -2;
+	}
+
+	if(conf.print)
+	{
+		int res = replay_print(in);
+		fclose(in);
+		if(res < 0)
+			fprintf(stderr, "%s: %s\n", capture, strerror(-res));
+		return (res < 0) ? -2 : 0;
+	}
+
+	int res = 0;
+	if(conf.snapshot != NULL && (res = copy_snapshot(conf.snapshot, image)) < 0)
+		fprintf(stderr, "copy %s to %s: %s\n", conf.snapshot, image, strerror(-res));
+	else if(conf.image_mb && (res = fresh_image(image, conf.image_mb, conf.cluster_size)) < 0)
+		fprintf(stderr, "format %s: %s\n", image, strerror(-res));
+
+	if(res < 0 || dfat_set_backend(conf.backend) < 0 || dfat_load(image) < 0)
+	{
+		if(res == 0)
+			fprintf(stderr, "dfat_load() %s failed\n", image);
+		fclose(in);
+		return -2;
+	}
+
+	struct dfat_capture_record r;
+	char path[2*PATH_MAX + 2];
+	unsigned long records = 0, skipped = 0;
+	uint64_t captured = 0, lag = 0;
+	uint64_t start = now_ns();
+
+	while((res = dfat_capture_read(in, &r, path, sizeof(path))) > 0)
+	{
+		if(r.op >= DFAT_CAP_OPS)
+			continue;
+
+		/* Paths were too long to capture, op can't be repeated */
+		if(r.path_len == DFAT_CAPTURE_OVERSIZE)
+		{
+			skipped++;
+			continue;
+		}
+
+		if(!conf.fast)
+		{
+			uint64_t at = start + r.start;
+			uint64_t now = now_ns();
+
+			if(now < at)
+			{
+				struct timespec ts = { at/1000000000, at%1000000000 };
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			}
+			else if(now - at > lag)
+				lag = now - at;
+		}
+
+		uint64_t t = now_ns();
+		int n = replay_record(&r, path);
+		uint64_t ns = now_ns() - t;
+
+		struct replay_stats *s = &stats[r.op];
+		s->count++;
+		s->captured_ns += r.duration;
+		s->replayed_ns += ns;
+		if(ns > s->max_ns)
+			s->max_ns = ns;
+		if(n < 0)
+		{
+			s->errors++;
+			if(conf.verbose)
+				fprintf(stderr, "%s %s: %s\n", dfat_capture_name(r.op), path, strerror(-n));
+		}
+
+		if(r.start + r.duration > captured)
+			captured = r.start + r.duration;
+		records++;
+	}
+
+	if(res < 0)
+		fprintf(stderr, "%s: %s after %lu records\n", capture, strerror(-res), records);
+	if(skipped)
+		fprintf(stderr, "%s: %lu records skipped, paths too long\n", capture, skipped);
+	fclose(in);
+
+	handle_release_all();
+	dfat_sync();
+	uint64_t replayed = now_ns() - start;
+
+	replay_summary(records, captured, replayed, conf.fast ? 0 : lag);
+
+	if(conf.verbose)
+	{
+		size_t len = dfat_stats_format(NULL, 0) + 1;
+		char *report = malloc(len);
+		if(report != NULL)
+		{
+			dfat_stats_format(report, len);
+			fputs(report, stderr);
+			free(report);
+		}
+	}
+
+	dfat_close();
+	free(data);
+	return 0;
+}
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <string.h>
+#include <time.h>
+
+/* Operation statistics */
+/* Per operation count, errors, latency histogram and device I/O. Latency
+ * goes to log-linear buckets: values below 16 ns exactly, then 8 buckets
+ * per power of two, so percentiles are within 12.5%. Device syscalls and
+ * bytes are charged to innermost operation of calling thread, I/O outside
+ * of operations (load, journal replay) goes to "other". Counters are
+ * updated by relaxed atomics, report is a snapshot, not a transaction. */
+
+#define HIST_LINEAR 16
+#define HIST_SUB 8
+#define HIST_BUCKETS (HIST_LINEAR + (64 - 4)*HIST_SUB)
+
+/* Count is sum of histogram */
+struct op_stats {
+	unsigned long errors;
+	unsigned long total_ns;
+	unsigned long max_ns;
+	unsigned long syscalls;
+	unsigned long bytes_read;
+	unsigned long bytes_written;
+	unsigned long hist[HIST_BUCKETS];
+};
+
+static struct op_stats ops[DFAT_OPS];
+static unsigned long files_mapped, extents_mapped;
+static __thread int current_op = DFAT_OP_OTHER;
+
+static const char *names[DFAT_OPS] = {
+	"lookup", "read", "write", "create", "unlink", "readdir", "alloc", "sync", "other"
+};
+
+static unsigned int hist_bucket(unsigned long ns)
+{
+	if(ns < HIST_LINEAR)
+		return ns;
+
+	unsigned int msb = 63 - __builtin_clzl(ns);
+	return HIST_LINEAR + (msb - 4)*HIST_SUB + ((ns >> (msb - 3)) & (HIST_SUB - 1));
+}
+
+/* Upper bound of bucket */
+static unsigned long hist_value(unsigned int bucket)
+{
+	if(bucket < HIST_LINEAR)
+		return bucket;
+
+	unsigned int msb = (bucket - HIST_LINEAR)/HIST_SUB + 4;
+	unsigned long sub = (bucket - HIST_LINEAR)%HIST_SUB;
+	return ((HIST_SUB + sub + 1) << (msb - 3)) - 1;
+}
+
+static unsigned long now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long) ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void dfat_stats_begin(struct dfat_op_timer *t, int op)
+{
+	t->op = op;
+	t->outer = current_op;
+	t->start = now_ns();
+	current_op = op;
+}
+
+/* res < 0 counts as error */
+void dfat_stats_end(struct dfat_op_timer *t, int res)
+{
+	unsigned long ns = now_ns() - t->start;
+	struct op_stats *s = &ops[t->op];
+
+	current_op = t->outer;
+
+	__atomic_add_fetch(&s->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->hist[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+	if(res < 0)
+		__atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+
+	unsigned long max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while(ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Device request of calling thread, bytes < 0 is failed request */
+void dfat_stats_io(unsigned int syscalls, ssize_t bytes, int write)
+{
+	struct op_stats *s = &ops[current_op];
+
+	if(syscalls)
+		__atomic_add_fetch(&s->syscalls, syscalls, __ATOMIC_RELAXED);
+	if(bytes > 0)
+		__atomic_add_fetch(write ? &s->bytes_written : &s->bytes_read, bytes, __ATOMIC_RELAXED);
+}
+
+/* Extent map of file was built */
+void dfat_stats_extents(unsigned int count)
+{
+	__atomic_add_fetch(&files_mapped, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&extents_mapped, count, __ATOMIC_RELAXED);
+}
+
+void dfat_stats_reset()
+{
+	memset(ops, 0, sizeof(ops));
+	files_mapped = 0;
+	extents_mapped = 0;
+}
+
+/* Smallest bucket bound covering part of count, in us, not above max */
+static double hist_percentile(unsigned long *hist, unsigned long count, double part, unsigned long max)
+{
+	unsigned long need = (unsigned long) (count*part);
+	unsigned long seen = 0;
+
+	if(need == 0)
+		need = 1;
+
+	for(unsigned int i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += hist[i];
+		if(seen >= need)
+			return ((hist_value(i) < max) ? hist_value(i) : max)/1000.0;
+	}
+
+	return 0;
+}
+
+size_t dfat_stats_format(char *buf, size_t size)
+{
+	size_t len = 0;
+	int n;
+
+#define STATS_PRINT(...) \
+	do { \
+		n = snprintf((len < size) ? buf + len : NULL, (len < size) ? size - len : 0, __VA_ARGS__); \
+		if(n > 0) \
+			len += n; \
+	} while(0)
+
+	STATS_PRINT("%-8s %10s %8s %12s %10s %10s %10s %10s %10s %10s %12s %12s\n",
+	            "op", "count", "errors", "total_ms", "p50_us", "p90_us", "p99_us", "p999_us", "max_us",
+	            "syscalls", "read_bytes", "write_bytes");
+
+	for(int op = 0; op < DFAT_OPS; op++)
+	{
+		struct op_stats s;
+		unsigned long hist[HIST_BUCKETS];
+		unsigned long count = 0;
+
+		/* Buckets are copied first, so percentiles agree with count */
+		for(unsigned int i = 0; i < HIST_BUCKETS; i++)
+		{
+			hist[i] = __atomic_load_n(&ops[op].hist[i], __ATOMIC_RELAXED);
+			count += hist[i];
+		}
+
+		s.errors = __atomic_load_n(&ops[op].errors, __ATOMIC_RELAXED);
+		s.total_ns = __atomic_load_n(&ops[op].total_ns, __ATOMIC_RELAXED);
+		s.max_ns = __atomic_load_n(&ops[op].max_ns, __ATOMIC_RELAXED);
+		s.syscalls = __atomic_load_n(&ops[op].syscalls, __ATOMIC_RELAXED);
+		s.bytes_read = __atomic_load_n(&ops[op].bytes_read, __ATOMIC_RELAXED);
+		s.bytes_written = __atomic_load_n(&ops[op].bytes_written, __ATOMIC_RELAXED);
+
+		STATS_PRINT("%-8s %10lu %8lu %12.3f %10.1f %10.1f %10.1f %10.1f %10.1f %10lu %12lu %12lu\n",
+		            names[op], count, s.errors, s.total_ns/1000000.0,
+		            hist_percentile(hist, count, 0.5, s.max_ns), hist_percentile(hist, count, 0.9, s.max_ns),
+		            hist_percentile(hist, count, 0.99, s.max_ns), hist_percentile(hist, count, 0.999, s.max_ns),
+		            s.max_ns/1000.0, s.syscalls, s.bytes_read, s.bytes_written);
+	}
+
+	unsigned long files = __atomic_load_n(&files_mapped, __ATOMIC_RELAXED);
+	unsigned long extents = __atomic_load_n(&extents_mapped, __ATOMIC_RELAXED);
+	STATS_PRINT("extents: %lu files mapped, %lu extents, %.2f per file\n",
+	            files, extents, files ? (double) extents/files : 0.0);
+	STATS_PRINT("space: %zu of %u clusters free\n", dfat_free_space(), fat_count);
+
+#undef STATS_PRINT
+
+	return len;
+}
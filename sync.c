@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Durability modes */
+/* always   - every modifying operation is synced before it returns
+ * fsync    - data and FAT reach device on fsync and unmount only
+ * periodic - group commit by background thread every interval ms */
+
+static int sync_mode = DFAT_SYNC_FSYNC;
+static unsigned int sync_interval = DFAT_SYNC_INTERVAL;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t sync_thread;
+static int sync_running;
+static pthread_mutex_t thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
+
+/* Set before dfat_load() */
+void dfat_set_sync_mode(int mode, unsigned int interval_ms)
+{
+	sync_mode = mode;
+	if(interval_ms)
+		sync_interval = interval_ms;
+}
+
+int dfat_sync_mode()
+{
+	return sync_mode;
+}
+
+/* Write back cached clusters and commit metadata journal, then wait for device */
+/* FAT is written in place by checkpoint when journal fills up */
+int dfat_sync()
+{
+	struct dfat_op_timer t;
+
+	dfat_stats_begin(&t, DFAT_OP_SYNC);
+	pthread_mutex_lock(&sync_lock);
+
+	int res = dfat_cache_flush();
+
+	/* Without journal FAT goes in place at every sync */
+	if(dfat_journal_commit() < 0 || dfat_journal_full() || sinfo.journal_size == 0)
+	{
+		if(dfat_journal_checkpoint() < 0 && res == 0)
+			res = -EIO;
+	}
+	else if(backend->sync() < 0 && res == 0)
+		res = -errno;
+
+	pthread_mutex_unlock(&sync_lock);
+
+	dfat_stats_end(&t, res);
+	dfat_trace(DFAT_TR_SYNC, 0, res);
+	return res;
+}
+
+/* End of modifying operation, called without FS locks */
+int dfat_commit()
+{
+	/* Journal must not overflow between syncs */
+	if(sync_mode == DFAT_SYNC_ALWAYS || dfat_journal_full())
+		return dfat_sync();
+
+	return 0;
+}
+
+static void *sync_loop(void *arg)
+{
+	pthread_mutex_lock(&thread_lock);
+
+	while(sync_running)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += sync_interval / 1000;
+		ts.tv_nsec += (long)(sync_interval % 1000) * 1000000;
+		if(ts.tv_nsec >= 1000000000)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&thread_cond, &thread_lock, &ts);
+		if(!sync_running)
+			break;
+
+		pthread_mutex_unlock(&thread_lock);
+		dfat_sync();
+		pthread_mutex_lock(&thread_lock);
+	}
+
+	pthread_mutex_unlock(&thread_lock);
+	return NULL;
+}
+
+int dfat_sync_start()
+{
+	if(sync_mode != DFAT_SYNC_PERIODIC)
+		return 0;
+
+	sync_running = 1;
+	if( pthread_create(&sync_thread, NULL, sync_loop, NULL) )
+	{
+		error("dfat_sync_start() can't start sync thread\n");
+		sync_running = 0;
+		return -1;
+	}
+
+	debug("FS\tperiodic sync every %u ms\n", sync_interval);
+	return 0;
+}
+
+void dfat_sync_stop()
+{
+	pthread_mutex_lock(&thread_lock);
+	int running = sync_running;
+	sync_running = 0;
+	pthread_cond_signal(&thread_cond);
+	pthread_mutex_unlock(&thread_lock);
+
+	if(running)
+		pthread_join(sync_thread, NULL);
+}
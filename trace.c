@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/* Binary trace */
+/* Every thread writes events to its own ring without locks: record is
+ * filled, then head is published with release order. Ring is registered
+ * once per thread and lives until process exit, so threads may come and go.
+ * dfat_trace_start() begins new epoch, ring of older epoch is reset by its
+ * owner at next event and skipped by dump. Records overwritten while dump
+ * runs may come out torn, dump after dfat_trace_stop() to avoid that. */
+
+/* Records per thread, power of 2 */
+#define TRACE_EVENTS 65536
+
+struct trace_ring {
+	struct dfat_trace_record records[TRACE_EVENTS];
+	unsigned long head;
+	unsigned int epoch;
+	uint32_t tid;
+	struct trace_ring *next;
+};
+
+int dfat_tracing;
+static unsigned int trace_epoch;
+static struct trace_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *ring;
+
+static const char *names[DFAT_TR_EVENTS] = {
+	"none", "lookup", "read", "write", "truncate", "create", "unlink", "rename",
+	"alloc", "free", "cache_miss", "writeback", "journal", "sync"
+};
+
+const char *dfat_trace_name(unsigned int event)
+{
+	return (event < DFAT_TR_EVENTS) ? names[event] : "unknown";
+}
+
+static struct trace_ring *ring_register()
+{
+	struct trace_ring *r = calloc(1, sizeof(struct trace_ring));
+	if(r == NULL)
+		return NULL;
+
+	r->tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&rings_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+
+	return r;
+}
+
+void dfat_trace_event(unsigned int event, uint64_t a, uint64_t b)
+{
+	struct trace_ring *r = ring;
+
+	if(r == NULL && (r = ring = ring_register()) == NULL)
+		return;
+
+	unsigned int epoch = __atomic_load_n(&trace_epoch, __ATOMIC_ACQUIRE);
+	if(r->epoch != epoch)
+	{
+		__atomic_store_n(&r->head, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&r->epoch, epoch, __ATOMIC_RELEASE);
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	unsigned long head = r->head;
+	struct dfat_trace_record *e = &r->records[head & (TRACE_EVENTS - 1)];
+
+	e->time = (uint64_t) ts.tv_sec*1000000000 + ts.tv_nsec;
+	e->event = event;
+	e->tid = r->tid;
+	e->a = a;
+	e->b = b;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Drop events of previous trace and start recording */
+void dfat_trace_start()
+{
+	__atomic_add_fetch(&trace_epoch, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&dfat_tracing, 1, __ATOMIC_RELEASE);
+}
+
+void dfat_trace_stop()
+{
+	__atomic_store_n(&dfat_tracing, 0, __ATOMIC_RELEASE);
+}
+
+/* Last TRACE_EVENTS records of every thread, decoded by tracedump */
+long dfat_trace_dump(const char *path)
+{
+	FILE *out = fopen(path, "wb");
+	if(out == NULL)
+		return -errno;
+
+	struct dfat_trace_header h = { DFAT_TRACE_MAGIC, 1, 0 };
+	int res = (fwrite(&h, sizeof(h), 1, out) == 1) ? 0 : -EIO;
+
+	unsigned int epoch = __atomic_load_n(&trace_epoch, __ATOMIC_ACQUIRE);
+
+	pthread_mutex_lock(&rings_lock);
+
+	for(struct trace_ring *r = rings; r != NULL && res == 0; r = r->next)
+	{
+		if(__atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE) != epoch)
+			continue;
+
+		unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		unsigned long count = (head < TRACE_EVENTS) ? head : TRACE_EVENTS;
+
+		/* Ring is written in two parts when it wrapped */
+		for(unsigned long i = head - count; i < head && res == 0; )
+		{
+			unsigned long pos = i & (TRACE_EVENTS - 1);
+			unsigned long n = TRACE_EVENTS - pos;
+			if(n > head - i)
+				n = head - i;
+
+			if(fwrite(&r->records[pos], sizeof(struct dfat_trace_record), n, out) != n)
+				res = -EIO;
+
+			i += n;
+		}
+
+		h.count += count;
+	}
+
+	pthread_mutex_unlock(&rings_lock);
+
+	if(res == 0 && (fseek(out, 0, SEEK_SET) < 0 || fwrite(&h, sizeof(h), 1, out) != 1))
+		res = -EIO;
+
+	if(fclose(out) != 0 && res == 0)
+		res = -EIO;
+
+	return (res < 0) ? res : (long) h.count;
+}
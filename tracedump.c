@@ -0,0 +1,81 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include "libdfat.h"
+
+/* Offline decoder of dfat_trace_dump() files */
+/* Records of all threads are merged by time and printed one per line,
+ * time is in microseconds from the first record. Per event counts follow. */
+
+static int record_cmp(const void *a, const void *b)
+{
+	const struct dfat_trace_record *x = a, *y = b;
+
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2 || !strcmp(argv[1], "--help")) {
+		printf("tracedump <trace file> [-s]\n"
+		       "\t-s  summary only\n");
+		return -1;
+	}
+
+	int summary = (argc > 2 && strcmp(argv[2], "-s") == 0);
+
+	FILE *in = fopen(argv[1], "rb");
+	if(in == NULL) {
+		perror(argv[1]);
+		return -2;
+	}
+
+	struct dfat_trace_header h;
+	if(fread(&h, sizeof(h), 1, in) != 1 || h.magic != DFAT_TRACE_MAGIC || h.version != 1) {
+		fprintf(stderr, "%s: not a dfat trace\n", argv[1]);
+		fclose(in);
+		return -2;
+	}
+
+	struct dfat_trace_record *records = malloc((h.count ? h.count : 1)*sizeof(struct dfat_trace_record));
+	if(records == NULL) {
+		perror("tracedump");
+		fclose(in);
+		return -3;
+	}
+
+	size_t count = fread(records, sizeof(struct dfat_trace_record), h.count, in);
+	fclose(in);
+
+	if(count < h.count)
+		fprintf(stderr, "%s: truncated, %zu of %llu records\n", argv[1], count, (unsigned long long) h.count);
+
+	qsort(records, count, sizeof(struct dfat_trace_record), record_cmp);
+
+	unsigned long counts[DFAT_TR_EVENTS + 1];
+	memset(counts, 0, sizeof(counts));
+
+	for(size_t i = 0; i < count; i++)
+	{
+		struct dfat_trace_record *e = &records[i];
+		counts[(e->event < DFAT_TR_EVENTS) ? e->event : DFAT_TR_EVENTS]++;
+
+		if(!summary)
+			printf("%14.3f %7u %-10s %20lld %20lld\n", (e->time - records[0].time)/1000.0,
+			       e->tid, dfat_trace_name(e->event), (long long) e->a, (long long) e->b);
+	}
+
+	printf("%zu records", count);
+	if(count)
+		printf(" in %.3f ms", (records[count-1].time - records[0].time)/1000000.0);
+	printf("\n");
+
+	for(unsigned int i = 0; i <= DFAT_TR_EVENTS; i++)
+	{
+		if(counts[i])
+			printf("%-10s %lu\n", dfat_trace_name(i), counts[i]);
+	}
+
+	free(records);
+	return 0;
+}
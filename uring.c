@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include "libdfat.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* io_uring backend */
+/* Raw syscalls, no liburing. A batch is submitted by one io_uring_enter
+ * and reaped as completions arrive, keeping up to URING_DEPTH requests in
+ * flight. Buffer registered by cache is used by fixed read/write. Without
+ * kernel support requests fall back to preadv/pwritev. */
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+
+#define URING_DEPTH 64
+
+static int ring_fd = -1;
+static unsigned int depth;
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_size, cq_ring_size, sqes_size;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+/* Registered buffer, index 0 */
+static byte_t *fixed_base;
+static size_t fixed_size;
+/* One submitter at a time */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ring_setup()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	ring_fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+	if(ring_fd < 0)
+		return -1;
+
+	depth = p.sq_entries;
+	sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(cq_ring_size > sq_ring_size)
+			sq_ring_size = cq_ring_size;
+		cq_ring_size = sq_ring_size;
+	}
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               ring_fd, IORING_OFF_SQ_RING);
+	if(sq_ring == MAP_FAILED)
+		goto fail;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ring = sq_ring;
+	else
+	{
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		               ring_fd, IORING_OFF_CQ_RING);
+		if(cq_ring == MAP_FAILED)
+			goto fail;
+	}
+
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	            ring_fd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED)
+		goto fail;
+
+	sq_head = (unsigned*)((byte_t*) sq_ring + p.sq_off.head);
+	sq_tail = (unsigned*)((byte_t*) sq_ring + p.sq_off.tail);
+	sq_mask = (unsigned*)((byte_t*) sq_ring + p.sq_off.ring_mask);
+	sq_array = (unsigned*)((byte_t*) sq_ring + p.sq_off.array);
+	cq_head = (unsigned*)((byte_t*) cq_ring + p.cq_off.head);
+	cq_tail = (unsigned*)((byte_t*) cq_ring + p.cq_off.tail);
+	cq_mask = (unsigned*)((byte_t*) cq_ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)((byte_t*) cq_ring + p.cq_off.cqes);
+
+	return 0;
+
+fail:
+	close(ring_fd);
+	ring_fd = -1;
+	return -1;
+}
+
+/* Called under ring_lock, or before ring is shared */
+static void ring_close()
+{
+	if(ring_fd < 0)
+		return;
+
+	munmap(sqes, sqes_size);
+	if(cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+	close(ring_fd);
+	ring_fd = -1;
+	fixed_base = NULL;
+	fixed_size = 0;
+}
+
+static void ring_prepare(struct io_uring_sqe *sqe, struct dfat_io *io, int index)
+{
+	byte_t *buf = io->iov[0].iov_base;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->off = io->offset;
+	sqe->user_data = index;
+
+	if(io->iovcnt == 1 && fixed_base != NULL && buf >= fixed_base
+	   && buf + io->iov[0].iov_len <= fixed_base + fixed_size)
+	{
+		sqe->opcode = io->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long) buf;
+		sqe->len = io->iov[0].iov_len;
+		sqe->buf_index = 0;
+	}
+	else
+	{
+		sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (unsigned long) io->iov;
+		sqe->len = io->iovcnt;
+	}
+}
+
+static int uring_aligned(struct dfat_io *io)
+{
+	laddr_t offset = io->offset;
+
+	for(int i = 0; i < io->iovcnt; i++)
+	{
+		if(!dfat_io_aligned(io->iov[i].iov_base, io->iov[i].iov_len, offset))
+			return 0;
+		offset += io->iov[i].iov_len;
+	}
+
+	return 1;
+}
+
+static void uring_bounce(struct dfat_io *io)
+{
+	io->res = 0;
+
+	for(int i = 0; i < io->iovcnt; i++)
+	{
+		ssize_t n = dfat_direct_rw(io->iov[i].iov_base, io->iov[i].iov_len, io->offset + io->res, io->write);
+
+		if(n < 0)
+		{
+			if(io->res == 0)
+				io->res = -errno;
+			return;
+		}
+
+		io->res += n;
+		if(n < io->iov[i].iov_len)
+			return;
+	}
+}
+
+/* Request by syscall, when ring is closed or dropped it */
+static void uring_sync_io(struct dfat_io *io)
+{
+	if(!uring_aligned(io))
+	{
+		uring_bounce(io);
+		return;
+	}
+
+	io->res = io->write ? pwritev(fd, io->iov, io->iovcnt, io->offset)
+	                    : preadv(fd, io->iov, io->iovcnt, io->offset);
+	dfat_stats_io(1, io->res, io->write);
+	if(io->res < 0)
+		io->res = -errno;
+}
+
+/* Take completions of batch, return their count. Called under ring_lock */
+static unsigned int ring_reap(struct dfat_io *io)
+{
+	unsigned head = *cq_head, reaped = 0;
+
+	while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+
+		io[cqe->user_data].res = cqe->res;
+		dfat_stats_io(0, cqe->res, io[cqe->user_data].write);
+		head++;
+		reaped++;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+	return reaped;
+}
+
+/* Ring is broken. Requests kernel has not taken yet are pulled back from
+ * the queue and marked -ECANCELED, like ones kernel canceled, to be redone
+ * by syscalls. Requests in flight are reaped first, so a late completion
+ * can't land over the retry; ones that can't be reaped fail with EIO.
+ * Called under ring_lock, ring is closed on return. */
+static void ring_abort(struct dfat_io *io, int next, unsigned tail, unsigned int queued)
+{
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	unsigned int inflight = queued - (tail - head);
+
+	for(unsigned t = head; t != tail; t++)
+		io[sqes[sq_array[t & *sq_mask]].user_data].res = -ECANCELED;
+	__atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+
+	inflight -= ring_reap(io);
+	while(inflight)
+	{
+		if(syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+		   && errno != EINTR)
+			break;
+		inflight -= ring_reap(io);
+	}
+
+	for(int i = 0; i < next; i++)
+	{
+		if(io[i].res == -EINPROGRESS)
+			io[i].res = -EIO;
+	}
+
+	ring_close();
+}
+
+static int uring_submit(struct dfat_io *io, int count)
+{
+	pthread_mutex_lock(&ring_lock);
+
+	if(ring_fd < 0)
+	{
+		pthread_mutex_unlock(&ring_lock);
+		for(int i = 0; i < count; i++)
+			uring_sync_io(&io[i]);
+		return 0;
+	}
+
+	int next = 0, completed = 0;
+	unsigned int inflight = 0, pending = 0;
+
+	while(completed < count)
+	{
+		unsigned tail = *sq_tail;
+
+		while(next < count && inflight + pending < depth)
+		{
+			if(!uring_aligned(&io[next]))
+			{
+				/* O_DIRECT bounce, synchronous */
+				uring_bounce(&io[next]);
+				next++;
+				completed++;
+				continue;
+			}
+
+			unsigned index = tail & *sq_mask;
+
+			ring_prepare(&sqes[index], &io[next], next);
+			sq_array[index] = index;
+			/* Marks request in flight till its completion is reaped */
+			io[next].res = -EINPROGRESS;
+			tail++;
+			next++;
+			pending++;
+		}
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+		/* Everything left was bounced */
+		if(pending == 0 && inflight == 0)
+			continue;
+
+		int submitted = syscall(__NR_io_uring_enter, ring_fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		dfat_stats_io(1, 0, 0);
+		if(submitted < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+			/* Ring is broken, closed for all submitters, rest goes by syscalls */
+			error("uring_submit() %s\n", strerror(errno));
+			ring_abort(io, next, tail, inflight + pending);
+			pthread_mutex_unlock(&ring_lock);
+
+			for(int i = 0; i < count; i++)
+			{
+				if(i >= next || io[i].res == -ECANCELED)
+					uring_sync_io(&io[i]);
+			}
+			return 0;
+		}
+
+		pending -= submitted;
+		inflight += submitted;
+
+		unsigned int reaped = ring_reap(io);
+		inflight -= reaped;
+		completed += reaped;
+	}
+
+	pthread_mutex_unlock(&ring_lock);
+	return 0;
+}
+
+static ssize_t uring_rw(void *buf, size_t size, laddr_t offset, int write)
+{
+	struct iovec iov = { buf, size };
+	struct dfat_io io = { &iov, 1, offset, write, 0 };
+
+	uring_submit(&io, 1);
+	if(io.res < 0)
+	{
+		errno = -io.res;
+		return -1;
+	}
+
+	return io.res;
+}
+
+static ssize_t uring_read_at(void *buf, size_t size, laddr_t offset)
+{
+	return uring_rw(buf, size, offset, 0);
+}
+
+static ssize_t uring_write_at(const void *buf, size_t size, laddr_t offset)
+{
+	return uring_rw((void*) buf, size, offset, 1);
+}
+
+static ssize_t uring_writev_at(const struct iovec *iov, int count, laddr_t offset)
+{
+	struct dfat_io io = { (struct iovec*) iov, count, offset, 1, 0 };
+
+	uring_submit(&io, 1);
+	if(io.res < 0)
+	{
+		errno = -io.res;
+		return -1;
+	}
+
+	return io.res;
+}
+
+/* Register buffer for fixed I/O, NULL drops registration */
+static int uring_register(void *base, size_t size)
+{
+	pthread_mutex_lock(&ring_lock);
+
+	if(ring_fd < 0)
+	{
+		pthread_mutex_unlock(&ring_lock);
+		return -1;
+	}
+
+	if(fixed_base != NULL)
+	{
+		syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		fixed_base = NULL;
+		fixed_size = 0;
+	}
+
+	int res = 0;
+	if(base != NULL)
+	{
+		struct iovec iov = { base, size };
+
+		/* May fail by RLIMIT_MEMLOCK, plain vectored I/O is used then */
+		res = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &iov, 1);
+		if(res == 0)
+		{
+			fixed_base = base;
+			fixed_size = size;
+		}
+	}
+
+	pthread_mutex_unlock(&ring_lock);
+	return res;
+}
+
+static int uring_open(const char *device)
+{
+	if(dfat_open_device(device) < 0)
+		return -1;
+
+	if(ring_setup() < 0)
+		error("uring_open() io_uring is not available: %s\n", strerror(errno));
+	else
+		debug("FS\tio_uring depth %u\n", depth);
+
+	return 0;
+}
+
+static int uring_sync()
+{
+	dfat_stats_io(1, 0, 0);
+	return fdatasync(fd);
+}
+
+static laddr_t uring_size()
+{
+	struct stat st;
+
+	return (fstat(fd, &st) < 0) ? 0 : st.st_size;
+}
+
+static void uring_close()
+{
+	pthread_mutex_lock(&ring_lock);
+	ring_close();
+	pthread_mutex_unlock(&ring_lock);
+	close(fd);
+}
+
+static struct dfat_backend uring_backend = {
+	"uring", uring_open, uring_read_at, uring_write_at, uring_writev_at,
+	uring_sync, uring_size, uring_close, uring_submit, uring_register
+};
+
+struct dfat_backend *dfat_uring_backend()
+{
+	return &uring_backend;
+}
+
+#else
+
+struct dfat_backend *dfat_uring_backend()
+{
+	return NULL;
+}
+
+#endif